@@ -16,7 +16,7 @@ CTF::CTF(){
 CTF::CTF(const std::vector<ctf_t>& values) : 
     data(values)
 {
-    assert(values.size() == 256);
+    assert(values.size() >= 2);
 }
 
 std::ostream& operator<<(std::ostream& os, const CTF& ctf){
@@ -34,11 +34,10 @@ bool CTF::loadCTF(CTF& ctf, const std::string& fileName){
         return false;
     }
 
-    //Read the data
-    assert(ctf.data.size() == 256);
+    //Read the data, one level per line, up to the first blank line
+    std::vector<CTF::ctf_t> values;
     std::string str;
-    for(int i = 0; i < 256; i++){
-        std::getline(fs, str);
+    while(std::getline(fs, str) && str.find_first_not_of(" \t\r") != std::string::npos){
 
         //Convert to ctf_t
         CTF::ctf_t exposure = static_cast<CTF::ctf_t>(strtod(str.c_str(), NULL));
@@ -49,27 +48,30 @@ bool CTF::loadCTF(CTF& ctf, const std::string& fileName){
             fs.close();
             return false;
         }
-        
-        //Update the CTF
-        ctf.data[i] = exposure;
+        values.push_back(exposure);
     }
-
-
-    const bool worked = fs.good();
     fs.close();
-    return worked;
+
+    //Update the CTF
+    if(values.size() < 2){
+        return false;
+    }
+    ctf.data.swap(values);
+    return true;
 }
 
 
 CTF CTF::makeLinearCTF(CTF::ctf_t maxCTFValue,
-    CTF::ctf_t minCTFValue)
+    CTF::ctf_t minCTFValue, size_t numLevels)
 {
     assert(minCTFValue < maxCTFValue);
+    assert(numLevels >= 2);
 
     CTF ctf;
-    CTF::ctf_t step = (maxCTFValue - minCTFValue) / static_cast<CTF::ctf_t>(255);
+    ctf.data.resize(numLevels);
+    CTF::ctf_t step = (maxCTFValue - minCTFValue) / static_cast<CTF::ctf_t>(numLevels - 1);
     CTF::ctf_t val = minCTFValue;
-    for(int pix = 0; pix <= 255; pix++){
+    for(size_t pix = 0; pix < numLevels; pix++){
         ctf.data[pix] = val; 
         val += step;
     }
@@ -9,7 +9,8 @@
 /**
  *  Class representing the camera transfer function of a camera(the CTF).  The goal of this
  *  software is to solve for these curves.  The CTF is a function, internal to the camera, that
- *  converts "irradiance" to 8 bit values.
+ *  converts "irradiance" to pixel values.  It is stored as one exposure value per pixel
+ *  value(level), so an 8 bit camera has a 256 entry CTF and a 12 bit camera a 4096 entry one.
  */
 class CTF{
 public:
@@ -18,11 +19,18 @@ public:
     //could change this to double if you like
     typedef float ctf_t;
 
+    //Pixel values, wide enough for sensors of up to 16 bits
+    typedef unsigned short pixel_t;
+
     /**
-     *  Initialize a CTF.
+     *  Initialize a CTF.  values holds the CTF value of each pixel value, and must have at
+     *  least 2 entries.
      */
     CTF(const std::vector<ctf_t>& values);
 
+    /**
+     *  Initialize a 256 entry(8 bit) CTF that is 0 everywhere.
+     */
     CTF();
 
     /**
@@ -30,6 +38,14 @@ public:
      */
     ctf_t operator()(unsigned char pixelVal)const;
 
+    /**
+     *  Load the CTF value for a particular pixel value in the range [0, getNumLevels()-1].
+     */
+    ctf_t at(size_t pixelVal)const;
+
+    /// Number of pixel values the CTF covers, 2^bits for a bits bit camera.
+    size_t getNumLevels()const;
+
     /**
      *  Write CTF to a stream.
      */
@@ -37,7 +53,9 @@ public:
 
     /**
      *  Load a CTF from disk.  Return true on success, false on failure.
-     *  The CTF ctf is modified to return the result.
+     *  The CTF ctf is modified to return the result.  The file has one value per line, and
+     *  the number of levels is the number of lines before the first blank line or the end
+     *  of the file; only the first column of each line is read.
      *  This is not a constructor because constructors have no good way to indicate failure.
      */
     static bool loadCTF(CTF& ctf, const std::string& fileName);
@@ -47,14 +65,15 @@ public:
      *
      *  @param maxCTFValue is the maximum CTF value.
      *  @param minimumCTFValue is the minimum CTF value.  Defaults to 0.
+     *  @param numLevels is the number of pixel values.  Defaults to 256.
      */
     static CTF makeLinearCTF(CTF::ctf_t maxCTFValue,
-        CTF::ctf_t minCTFValue = static_cast<CTF::ctf_t>(0.0));
+        CTF::ctf_t minCTFValue = static_cast<CTF::ctf_t>(0.0), size_t numLevels = 256);
 
 
 private:
 
-    std::vector<CTF::ctf_t> data; //Array of length num_bits (currently 256)
+    std::vector<CTF::ctf_t> data; //Array of length 2^num_bits
 };
 
 
@@ -63,6 +82,15 @@ inline CTF::ctf_t CTF::operator()(unsigned char pixelVal)const{
     return data[pixelVal];
 }
 
+inline CTF::ctf_t CTF::at(size_t pixelVal)const{
+    assert(pixelVal < data.size());
+    return data[pixelVal];
+}
+
+inline size_t CTF::getNumLevels()const{
+    return data.size();
+}
+
 
 
 #endif //CTF_H
@@ -0,0 +1,214 @@
+#include "CTFAccumulator.h"
+//--
+#include <algorithm>
+#include <limits>
+
+const size_t CTFAccumulator::REJECTED = std::numeric_limits<size_t>::max();
+
+CTFAccumulator::CTFAccumulator(size_t numSamps, const CTF::ctf_t* weights, size_t numLevels) :
+    numSamples(numSamps), numExposures(0), wLut(weights, weights + numLevels),
+    curveDiag(numLevels, static_cast<CTF::ctf_t>(0.0)),
+    curveRHS(numLevels, static_cast<CTF::ctf_t>(0.0)),
+    sampleDiag(numSamps, static_cast<CTF::ctf_t>(0.0)), sampleRHS(numSamps, static_cast<CTF::ctf_t>(0.0)),
+    sampleMult(numSamps, static_cast<CTF::ctf_t>(1.0))
+{
+    assert(weights != NULL);
+    assert(numLevels >= 2);
+}
+
+
+void CTFAccumulator::addExposure(const CTF::pixel_t* pixVals, CTF::ctf_t logTime){
+    assert(pixVals != NULL || numSamples == 0);
+
+    values.insert(values.end(), pixVals, pixVals + numSamples);
+    logTimes.push_back(logTime);
+    ++numExposures;
+
+    for(size_t i = 0; i < numSamples; i++){
+        const CTF::pixel_t pixVal = pixVals[i];
+        assert(pixVal < wLut.size());
+        const CTF::ctf_t w2 = wLut[pixVal] * wLut[pixVal];
+
+        curveDiag[pixVal] += w2;
+        curveRHS[pixVal]  += w2 * logTime;
+        sampleDiag[i]     += w2;
+        sampleRHS[i]      += w2 * logTime;
+    }
+}
+
+
+//Orders samples lexicographically by their pixel values in each exposure
+typedef struct SampleValuesLess{
+    SampleValuesLess(const CTFAccumulator& acc) : system(acc) {}
+
+    bool operator()(size_t a, size_t b)const{
+        for(size_t j = 0; j < system.getNumExposures(); j++){
+            const CTF::pixel_t va = system.getPixelValue(a,j);
+            const CTF::pixel_t vb = system.getPixelValue(b,j);
+            if(va != vb){
+                return va < vb;
+            }
+        }
+        return false;
+    }
+
+    const CTFAccumulator& system;
+}SampleValuesLess;
+
+
+std::vector<size_t> CTFAccumulator::mergeDuplicateSamples(){
+
+    //Sort the samples so that duplicates are next to each other
+    std::vector<size_t> sorted(numSamples);
+    for(size_t i = 0; i < numSamples; i++){
+        sorted[i] = i;
+    }
+    SampleValuesLess less(*this);
+    std::sort(sorted.begin(), sorted.end(), less);
+
+    //Assign each group of duplicates to one merged sample
+    std::vector<size_t> sampleMap(numSamples);
+    std::vector<size_t> firstOfGroup; //An original sample from each group
+    for(size_t k = 0; k < numSamples; k++){
+        if(k == 0 || less(sorted[k-1], sorted[k])){
+            firstOfGroup.push_back(sorted[k]);
+        }
+        sampleMap[sorted[k]] = firstOfGroup.size() - 1;
+    }
+    const size_t numMerged = firstOfGroup.size();
+
+    //Sum the per-sample terms of each group
+    std::vector<CTF::ctf_t> mergedDiag(numMerged, static_cast<CTF::ctf_t>(0.0));
+    std::vector<CTF::ctf_t> mergedRHS (numMerged, static_cast<CTF::ctf_t>(0.0));
+    std::vector<CTF::ctf_t> mergedMult(numMerged, static_cast<CTF::ctf_t>(0.0));
+    for(size_t i = 0; i < numSamples; i++){
+        mergedDiag[sampleMap[i]] += sampleDiag[i];
+        mergedRHS [sampleMap[i]] += sampleRHS[i];
+        mergedMult[sampleMap[i]] += sampleMult[i];
+    }
+
+    //Keep one copy of the pixel values of each group
+    std::vector<CTF::pixel_t> mergedValues(numMerged * numExposures);
+    for(size_t j = 0; j < numExposures; j++){
+        for(size_t u = 0; u < numMerged; u++){
+            mergedValues[j*numMerged + u] = values[j*numSamples + firstOfGroup[u]];
+        }
+    }
+
+    numSamples = numMerged;
+    values.swap(mergedValues);
+    sampleDiag.swap(mergedDiag);
+    sampleRHS.swap(mergedRHS);
+    sampleMult.swap(mergedMult);
+
+    return sampleMap;
+}
+
+
+std::vector<size_t> CTFAccumulator::rejectNonMonotonicSamples(int tolerance){
+    if(numSamples == 0){
+        return std::vector<size_t>();
+    }
+
+    //Visit exposures from shortest to longest
+    std::vector< std::pair<CTF::ctf_t,size_t> > byTime(numExposures);
+    for(size_t j = 0; j < numExposures; j++){
+        byTime[j] = std::make_pair(logTimes[j], j);
+    }
+    std::sort(byTime.begin(), byTime.end());
+
+    //Track the highest value seen in strictly shorter exposures, and flag any sample that
+    //falls too far below it
+    std::vector<int> maxShorter(numSamples, -1);
+    std::vector<int> maxSoFar(numSamples, -1);
+    std::vector<bool> keep(numSamples, true);
+    for(size_t k = 0; k < numExposures; k++){
+        if(k > 0 && byTime[k].first != byTime[k-1].first){
+            maxShorter = maxSoFar;
+        }
+        const CTF::pixel_t* vals = &(values[byTime[k].second * numSamples]);
+        for(size_t i = 0; i < numSamples; i++){
+            keep[i] = keep[i] && (int)vals[i] >= maxShorter[i] - tolerance;
+            maxSoFar[i] = std::max(maxSoFar[i], (int)vals[i]);
+        }
+    }
+
+    //Compact the kept samples
+    std::vector<size_t> sampleMap(numSamples, REJECTED);
+    size_t numKept = 0;
+    for(size_t i = 0; i < numSamples; i++){
+        if(keep[i]){
+            sampleMap[i] = numKept++;
+        }
+    }
+    if(numKept == numSamples){
+        return sampleMap;
+    }
+
+    std::vector<CTF::pixel_t> keptValues(numKept * numExposures);
+    for(size_t j = 0; j < numExposures; j++){
+        for(size_t i = 0; i < numSamples; i++){
+            if(keep[i]){
+                keptValues[j*numKept + sampleMap[i]] = values[j*numSamples + i];
+            }
+        }
+    }
+    for(size_t i = 0; i < numSamples; i++){
+        if(keep[i]){
+            sampleDiag[sampleMap[i]] = sampleDiag[i];
+            sampleRHS [sampleMap[i]] = sampleRHS[i];
+            sampleMult[sampleMap[i]] = sampleMult[i];
+        }
+    }
+
+    numSamples = numKept;
+    values.swap(keptValues);
+    sampleDiag.resize(numKept);
+    sampleRHS.resize(numKept);
+    sampleMult.resize(numKept);
+    recomputeCurveSums();
+
+    return sampleMap;
+}
+
+
+void CTFAccumulator::scaleSamples(const std::vector<CTF::ctf_t>& factors){
+    assert(factors.size() == numSamples);
+    for(size_t i = 0; i < numSamples; i++){
+        sampleDiag[i] *= factors[i];
+        sampleRHS[i]  *= factors[i];
+        sampleMult[i] *= factors[i];
+    }
+    recomputeCurveSums();
+}
+
+
+void CTFAccumulator::recomputeCurveSums(){
+    std::fill(curveDiag.begin(), curveDiag.end(), static_cast<CTF::ctf_t>(0.0));
+    std::fill(curveRHS.begin(),  curveRHS.end(),  static_cast<CTF::ctf_t>(0.0));
+    if(numSamples == 0){
+        return;
+    }
+    for(size_t j = 0; j < numExposures; j++){
+        const CTF::pixel_t* vals = &(values[j*numSamples]);
+        for(size_t i = 0; i < numSamples; i++){
+            const CTF::ctf_t w2 = sampleMult[i] * wLut[vals[i]] * wLut[vals[i]];
+            curveDiag[vals[i]] += w2;
+            curveRHS[vals[i]]  += w2 * logTimes[j];
+        }
+    }
+}
+
+
+CTFAccumulator CTFAccumulator::rebinned(int shift, const CTF::ctf_t* weights)const{
+    CTFAccumulator ret(numSamples, weights, getNumLevels() >> shift);
+    std::vector<CTF::pixel_t> binned(numSamples);
+    for(size_t j = 0; j < numExposures; j++){
+        for(size_t i = 0; i < numSamples; i++){
+            binned[i] = values[j*numSamples + i] >> shift;
+        }
+        ret.addExposure(numSamples == 0 ? NULL : &(binned[0]), logTimes[j]);
+    }
+    ret.scaleSamples(sampleMult);
+    return ret;
+}
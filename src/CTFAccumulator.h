@@ -0,0 +1,190 @@
+#ifndef CTF_ACCUMULATOR_H
+#define CTF_ACCUMULATOR_H
+
+#include <vector>
+#include <cassert>
+#include <cmath>
+//--
+#include "CTF.h"
+
+/**
+ *  Accumulates the normal equations of the Debevec and Malik linear system, one exposure
+ *  at a time, without ever forming the system matrix.
+ *
+ *  Every fitting equation w(Z) * (g(Z) - ln(E_i)) = w(Z) * ln(t) touches exactly one CTF
+ *  unknown and one irradiance unknown, so the normal equations have a very compact form:
+ *  a diagonal block for the CTF unknowns, a diagonal block for the irradiance unknowns,
+ *  and a coupling block whose entries are just squared weights of the sampled pixel values.
+ *  We store the two diagonals with their right hand sides, and the coupling block as the
+ *  sampled pixel values themselves; this is a few hundred KB for typical sample counts.
+ *
+ *  The smoothness equations do not depend on the images, so they are left to the solver.
+ */
+class CTFAccumulator{
+public:
+
+    /**
+     *  Create an empty system.
+     *
+     *  @param numSamps is the number of sample positions in each exposure.
+     *  @param weights is the weighting function sampled into a numLevels entry LUT.
+     *  @param numLevels is the number of CTF unknowns, one per pixel value(or bin of pixel
+     *   values).  Defaults to 256 for 8 bit images.
+     */
+    CTFAccumulator(size_t numSamps, const CTF::ctf_t* weights, size_t numLevels = 256);
+
+    /**
+     *  Add one exposure to the system.
+     *
+     *  @param pixVals are the pixel values at each of the numSamps sample positions, each
+     *   less than numLevels.
+     *  @param logTime is the natural log of the exposure time.
+     */
+    void addExposure(const CTF::pixel_t* pixVals, CTF::ctf_t logTime);
+
+    size_t getNumSamples()const;
+    size_t getNumExposures()const;
+    size_t getNumLevels()const;
+
+    /// Pixel value of sample i in exposure j.
+    CTF::pixel_t getPixelValue(size_t i, size_t j)const;
+    /// Natural log of the exposure time of exposure j.
+    CTF::ctf_t getLogTime(size_t j)const;
+    /// Weight of a pixel value.
+    CTF::ctf_t getWeight(CTF::pixel_t pixVal)const;
+    /// The weighting function as a numLevels entry LUT.
+    const CTF::ctf_t* getWeightLUT()const;
+
+    /// Diagonal entry and right hand side of the normal equations for the CTF unknown
+    /// at pixVal.  These only include the fitting equations.
+    CTF::ctf_t getCurveDiagonal(CTF::pixel_t pixVal)const;
+    CTF::ctf_t getCurveRHS(CTF::pixel_t pixVal)const;
+
+    /// Diagonal entry and right hand side of the normal equations for the irradiance
+    /// unknown of sample i.  The right hand side is negated, so it is positive.
+    CTF::ctf_t getSampleDiagonal(size_t i)const;
+    CTF::ctf_t getSampleRHS(size_t i)const;
+
+    /// Number of original samples merged into sample i, and its square root, which
+    /// scales the weight of each of the sample's fitting equations.
+    CTF::ctf_t getSampleMultiplicity(size_t i)const;
+    CTF::ctf_t getSampleScale(size_t i)const;
+
+    /**
+     *  Merge samples that have the same pixel value in every exposure.
+     *
+     *  Such samples give identical fitting equations and have the same solution, so each
+     *  group is replaced by a single sample whose equations are weighted by the size of
+     *  the group.  The solution of the system is unchanged, but the system is smaller;
+     *  this matters in smooth image regions and on low noise sensors.
+     *  Call this after all exposures have been added.
+     *
+     *  @return the index of the merged sample that each original sample became.
+     */
+    std::vector<size_t> mergeDuplicateSamples();
+
+    /// Value returned by rejectNonMonotonicSamples(...) for samples that were dropped.
+    static const size_t REJECTED;
+
+    /**
+     *  Drop samples whose pixel values are not monotonic in exposure time.
+     *
+     *  A longer exposure of the same scene point can never give a lower pixel value, so a
+     *  sample whose value falls as exposure time increases has landed on something that
+     *  moved or on a misaligned edge.  Its fitting equations are inconsistent with those of
+     *  the other samples and only pull the curve away from the truth.  A sample is dropped
+     *  if, in any exposure, its value is more than tolerance below its value in some
+     *  strictly shorter exposure; the tolerance absorbs sensor noise.
+     *  Call this after all exposures have been added.
+     *
+     *  @return the index of the kept sample that each original sample became, or REJECTED.
+     */
+    std::vector<size_t> rejectNonMonotonicSamples(int tolerance);
+
+    /**
+     *  Scale the weight of every fitting equation of each sample, as if sample i were
+     *  repeated factors[i] more times.  Used to reweight samples between robust refits.
+     */
+    void scaleSamples(const std::vector<CTF::ctf_t>& factors);
+
+    /**
+     *  Make a copy of the system with 2^shift consecutive pixel values sharing each CTF
+     *  unknown, so it has numLevels >> shift unknowns.  Samples keep their multiplicities.
+     *
+     *  @param weights is the weighting function of the new system, as a LUT with an entry
+     *   for each of its unknowns.
+     */
+    CTFAccumulator rebinned(int shift, const CTF::ctf_t* weights)const;
+
+private:
+    //Recompute curveDiag and curveRHS from the samples and their multiplicities
+    void recomputeCurveSums();
+
+    size_t numSamples;
+    size_t numExposures;
+    std::vector<CTF::ctf_t> wLut; //Weighting function
+
+    std::vector<CTF::pixel_t> values; //values[j*numSamples + i] is sample i in exposure j
+    std::vector<CTF::ctf_t> logTimes;  //Log exposure time of each exposure
+
+    std::vector<CTF::ctf_t> curveDiag;  //Sum of w^2 over all samples of each pixel value
+    std::vector<CTF::ctf_t> curveRHS;   //Sum of w^2 * ln(t) over all samples of each pixel value
+    std::vector<CTF::ctf_t> sampleDiag; //Sum of w^2 over all exposures of each sample
+    std::vector<CTF::ctf_t> sampleRHS;  //Sum of w^2 * ln(t) over all exposures of each sample
+    std::vector<CTF::ctf_t> sampleMult; //Number of original samples merged into each sample
+};
+
+
+inline size_t CTFAccumulator::getNumSamples()const{
+    return numSamples;
+}
+inline size_t CTFAccumulator::getNumExposures()const{
+    return numExposures;
+}
+inline size_t CTFAccumulator::getNumLevels()const{
+    return wLut.size();
+}
+
+inline CTF::pixel_t CTFAccumulator::getPixelValue(size_t i, size_t j)const{
+    assert(i < numSamples && j < numExposures);
+    return values[j*numSamples + i];
+}
+inline CTF::ctf_t CTFAccumulator::getLogTime(size_t j)const{
+    assert(j < numExposures);
+    return logTimes[j];
+}
+inline CTF::ctf_t CTFAccumulator::getWeight(CTF::pixel_t pixVal)const{
+    assert(pixVal < wLut.size());
+    return wLut[pixVal];
+}
+inline const CTF::ctf_t* CTFAccumulator::getWeightLUT()const{
+    return &(wLut[0]);
+}
+
+inline CTF::ctf_t CTFAccumulator::getCurveDiagonal(CTF::pixel_t pixVal)const{
+    return curveDiag[pixVal];
+}
+inline CTF::ctf_t CTFAccumulator::getCurveRHS(CTF::pixel_t pixVal)const{
+    return curveRHS[pixVal];
+}
+
+inline CTF::ctf_t CTFAccumulator::getSampleDiagonal(size_t i)const{
+    assert(i < numSamples);
+    return sampleDiag[i];
+}
+inline CTF::ctf_t CTFAccumulator::getSampleRHS(size_t i)const{
+    assert(i < numSamples);
+    return sampleRHS[i];
+}
+
+inline CTF::ctf_t CTFAccumulator::getSampleMultiplicity(size_t i)const{
+    assert(i < numSamples);
+    return sampleMult[i];
+}
+inline CTF::ctf_t CTFAccumulator::getSampleScale(size_t i)const{
+    assert(i < numSamples);
+    return sqrt(sampleMult[i]);
+}
+
+
+#endif //CTF_ACCUMULATOR_H
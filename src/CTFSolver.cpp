@@ -2,6 +2,9 @@
 //--
 #include <cassert>
 #include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 //--
 #define cimg_display 0    //Don't compile cimg to use X11 displays
 #define cimg_verbosity 0   // Disable modal window in CImg exceptions.
@@ -12,15 +15,30 @@ using namespace cimg_library;
 //--
 #include "Eigen/Eigen"
 #include "Eigen/Dense"
+#define EIGEN_YES_I_KNOW_SPARSE_MODULE_IS_NOT_STABLE_YET
+#include "Eigen/Sparse"
+//--
+#include "CTFAccumulator.h"
+#include "ImageProbe.h"
+#include "MappedImage.h"
+#include "RandomGenerator.h"
+#include "SampledImageReader.h"
+#include "Stopwatch.h"
+//--
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 bool CTFSolver::checkImagesOK(std::vector<CTFSolver::ImageExposurePair>& images,
-    int& outWidth, int& outHeight, int& outMinNumChans, std::string* reason)
+    int& outWidth, int& outHeight, int& outMinNumChans, std::string* reason,
+    int* outMaxBitDepth)
 {
     if(reason != NULL){
         *reason = "";
     }
-    //Load each image and see if CImg throws
+    //Read each image's header, and only load the image(and see if CImg throws) when the
+    //header cannot be read.
     //If you are using this code and can't figure out why CImg is failing to load your images,
     //check the following:
     //
@@ -32,23 +50,31 @@ bool CTFSolver::checkImagesOK(std::vector<CTFSolver::ImageExposurePair>& images,
     //    For some file types, CImg can read the file's header(usually via a magic number in the header) and figure things
     //    out but this is not always the case.
     //
-    //    Make sure your images are 8 bit images!
+    //    Make sure your images are 8 bit images, or pass the sensor's bit depth!
 
     outWidth = outHeight = outMinNumChans = -1;
+    if(outMaxBitDepth != NULL){
+        *outMaxBitDepth = -1;
+    }
     try{
         for(size_t i = 0; i < images.size(); i++){
-            CImg<unsigned char> im(images[i].imagePath.c_str());
+            ImageProbe::ImageInfo info;
+            if(!ImageProbe::probe(images[i].imagePath, info)){
+                //Other formats are assumed to hold 8 bit values
+                CImg<unsigned char> im(images[i].imagePath.c_str());
+                info.width    = im.width();
+                info.height   = im.height();
+                info.numChans = im.spectrum();
+                info.bitDepth = 8;
+            }
+
             if(i == 0){
-                outWidth       = im.width();
-                outHeight      = im.width();
-                outMinNumChans = im.spectrum();
+                outWidth       = info.width;
+                outHeight      = info.height;
+                outMinNumChans = info.numChans;
             }else{
-                int myWidth    = im.width();
-                int myHeight   = im.width();
-                int myNumChans = im.spectrum();
-
                 //Check for dimension mismatch
-                if(myWidth != outWidth || myHeight != outHeight){
+                if(info.width != outWidth || info.height != outHeight){
                     if(reason != NULL){
                         *reason = "Dimension Mismatch";
                     }
@@ -56,7 +82,10 @@ bool CTFSolver::checkImagesOK(std::vector<CTFSolver::ImageExposurePair>& images,
                 }
 
                 //Find minimal # of channels
-                outMinNumChans = std::min<int>(myNumChans, outMinNumChans);
+                outMinNumChans = std::min<int>(info.numChans, outMinNumChans);
+            }
+            if(outMaxBitDepth != NULL){
+                *outMaxBitDepth = std::max<int>(info.bitDepth, *outMaxBitDepth);
             }
         }
     }catch(const CImgException& ex){
@@ -91,31 +120,17 @@ std::ostream& operator<<(std::ostream& os, const CTFSolver::ImageExposurePair& i
 }
 
 
-//TODO: Use a better RNG
-static int randomInt(int minInclusive, int maxExclusive){
-    assert(maxExclusive > minInclusive);
-    const int val =  minInclusive + (rand() % (maxExclusive - minInclusive));
-    assert(val >= minInclusive && val < maxExclusive);
-    return val;
-}
-
-
-typedef struct SamplePos{
-    SamplePos(int xPos = -1, int yPos = -1) :
-        x(xPos), y(yPos){}
-    int x,y;
-}SamplePos;
-
-static std::vector<SamplePos> genRandomSamples(int widthMax, int heightMax, int numSamps){
+static std::vector<SamplePos> genRandomSamples(int widthMax, int heightMax, int numSamps,
+    RandomGenerator& rng)
+{
 
     //Allocate space
     std::vector<SamplePos> ret;
     ret.resize((size_t)numSamps);
 
     //Add samples
-    //TODO: Use stochastic sampling not pure random
     for(int i = 0; i < numSamps; i++){
-        SamplePos sample(randomInt(0,widthMax), randomInt(0,heightMax));
+        SamplePos sample(rng.uniformInt(0,widthMax), rng.uniformInt(0,heightMax));
         ret[i] = sample;
     }
 
@@ -123,14 +138,278 @@ static std::vector<SamplePos> genRandomSamples(int widthMax, int heightMax, int
 }
 
 
+/**
+ *  Generate sample positions that are stratified spatially and balanced across intensities.
+ *
+ *  Candidate positions are drawn with jittered grid sampling, several per sample we need,
+ *  so they cover the image evenly.  The candidates are binned by their value in the
+ *  reference image, and each bin gets an equal share of the samples; bins with too few
+ *  candidates give their leftover share to the others.  Pure random sampling draws most
+ *  samples from the most common intensities, so many more samples are needed before
+ *  every part of the curve is constrained.
+ *
+ *  @param ref is the reference image, typically the middle exposure of the stack.  It is a
+ *   CImg image or an ImageView.
+ *  @param chan is the channel of ref to balance intensities in.
+ *  @param maxValue is the largest pixel value of the sensor.
+ */
+template<typename Image>
+static std::vector<SamplePos> genStratifiedSamples(const Image& ref, size_t chan,
+    int maxValue, int numSamps, RandomGenerator& rng)
+{
+    const int NUM_BINS       = 32; //Intensity bins, each 1/32 of the pixel value range
+    const int CANDS_PER_SAMP = 8;  //How many candidates to draw per sample
+
+    const int width  = ref.width();
+    const int height = ref.height();
+    const long numPixels = static_cast<long>(width) * height;
+    const long numCands  = std::min<long>(static_cast<long>(numSamps) * CANDS_PER_SAMP, numPixels);
+
+    //Jittered grid of candidates, with roughly square cells
+    const int gridW = std::max(1, std::min(width,
+        static_cast<int>(sqrt(static_cast<double>(numCands) * width / height) + 0.5)));
+    const int gridH = std::max(1, std::min(height,
+        static_cast<int>((numCands + gridW - 1) / gridW)));
+    const float cellW = static_cast<float>(width)  / gridW;
+    const float cellH = static_cast<float>(height) / gridH;
+    std::vector< std::vector<SamplePos> > bins(NUM_BINS);
+    for(int cy = 0; cy < gridH; cy++){
+        for(int cx = 0; cx < gridW; cx++){
+            const int x = std::min(width-1,  static_cast<int>((cx + rng.uniformFloat()) * cellW));
+            const int y = std::min(height-1, static_cast<int>((cy + rng.uniformFloat()) * cellH));
+            const long v = std::min<long>(ref(x,y,0,chan), maxValue);
+            bins[v * NUM_BINS / (maxValue + 1)].push_back(SamplePos(x,y));
+        }
+    }
+
+    //Visit bins from least to most populated, giving each an equal share of what is left
+    std::vector< std::pair<size_t,int> > binOrder;
+    for(int b = 0; b < NUM_BINS; b++){
+        binOrder.push_back(std::make_pair(bins[b].size(), b));
+    }
+    std::sort(binOrder.begin(), binOrder.end());
+
+    std::vector<SamplePos> ret;
+    ret.reserve(numSamps);
+    for(int k = 0; k < NUM_BINS; k++){
+        std::vector<SamplePos>& bin = bins[binOrder[k].second];
+        const size_t share = (numSamps - ret.size()) / (NUM_BINS - k);
+        const size_t count = std::min(share, bin.size());
+
+        //Partial Fisher-Yates shuffle to take a random subset of the bin
+        for(size_t i = 0; i < count; i++){
+            std::swap(bin[i], bin[rng.uniformInt(static_cast<int>(i), static_cast<int>(bin.size()))]);
+            ret.push_back(bin[i]);
+        }
+    }
+
+    //Top up with random samples in case there were too few candidates(tiny images)
+    while(ret.size() < (size_t)numSamps){
+        ret.push_back(SamplePos(rng.uniformInt(0,width), rng.uniformInt(0,height)));
+    }
+
+    return ret;
+}
+
+
+//Copy the values of some channels at every sample position out of a decoded image or a view
+template<typename Image>
+static void extractSamples(const Image& im, const std::vector<SamplePos>& samples,
+    const std::vector<size_t>& channels, std::vector< std::vector<unsigned short> >& outValues)
+{
+    outValues.resize(channels.size());
+    for(size_t c = 0; c < channels.size(); c++){ //Loop over channels
+        assert((size_t)im.spectrum() > channels[c]);
+
+        outValues[c].resize(samples.size());
+        for(size_t i = 0; i < samples.size(); i++){ //Loop over sample positions
+            outValues[c][i] = im(samples[i].x, samples[i].y, 0, channels[c]);
+        }
+    }
+}
+
+
+/**
+ *  Downsample an image by averaging blockSize x blockSize blocks of pixels, rounding to the
+ *  nearest integer.  Partial blocks at the right and bottom edges are dropped.  This is
+ *  level log2(blockSize) of a box filtered image pyramid, computed in one pass.
+ */
+template<typename T>
+static CImg<T> boxDownsample(const CImg<T>& im, int blockSize){
+    const int width  = im.width()  / blockSize;
+    const int height = im.height() / blockSize;
+    const unsigned int area = blockSize * blockSize;
+
+    CImg<T> ret(width, height, 1, im.spectrum());
+    std::vector<unsigned int> sums(width);
+    for(int c = 0; c < im.spectrum(); c++){
+        for(int y = 0; y < height; y++){
+            std::fill(sums.begin(), sums.end(), 0);
+            for(int dy = 0; dy < blockSize; dy++){
+                const T* row = im.data(0, y*blockSize + dy, 0, c);
+                for(int x = 0; x < width; x++){
+                    for(int dx = 0; dx < blockSize; dx++){
+                        sums[x] += row[x*blockSize + dx];
+                    }
+                }
+            }
+            for(int x = 0; x < width; x++){
+                ret(x,y,0,c) = static_cast<T>((sums[x] + area/2) / area);
+            }
+        }
+    }
+    return ret;
+}
+
+
+//Decode a whole image with CImg, downsample it to blocks, and extract the sample values
+template<typename T>
+static void decodeSamples(const std::string& path, int blockSize,
+    const std::vector<SamplePos>& samples, const std::vector<size_t>& channels,
+    int width, int height, std::vector< std::vector<unsigned short> >& outValues)
+{
+    CImg<T> im(path.c_str());
+    if(blockSize > 1){
+        im = boxDownsample(im, blockSize);
+    }
+    assert(im.width() == width);
+    assert(im.height() == height);
+    extractSamples(im, samples, channels, outValues);
+}
+
+
+/**
+ *  Read the values of some channels at every sample position of an image file.  Only the
+ *  rows holding samples are decoded when the reader supports the file's format; otherwise
+ *  the whole image is decoded, as 16 bit values if wide is true.  Samples and dimensions
+ *  are in the reader's blocks.
+ */
+static void readSamples(const std::string& path, const SampledImageReader& reader,
+    const std::vector<SamplePos>& samples, const std::vector<size_t>& channels,
+    int width, int height, bool wide, std::vector< std::vector<unsigned short> >& outValues)
+{
+    //8 bit PGM and PPM files are read in place, which only touches the pages holding samples
+    if(reader.getBlockSize() == 1){
+        MappedImage mapped;
+        if(mapped.open(path) && mapped.getView().width() == width &&
+            mapped.getView().height() == height)
+        {
+            extractSamples(mapped.getView(), samples, channels, outValues);
+            return;
+        }
+    }
+
+    int readWidth, readHeight;
+    if(reader.read(path, channels, outValues, readWidth, readHeight)){
+        assert(readWidth == width);
+        assert(readHeight == height);
+        return;
+    }
+
+    if(wide){
+        decodeSamples<unsigned short>(path, reader.getBlockSize(), samples, channels,
+            width, height, outValues);
+    }else{
+        decodeSamples<unsigned char>(path, reader.getBlockSize(), samples, channels,
+            width, height, outValues);
+    }
+}
+
+
+//Level of a pixel value of a bitDepth bit sensor, when 2^binShift pixel values share a level
+static CTF::pixel_t pixelLevel(unsigned int pixVal, int bitDepth, int binShift){
+    const unsigned int maxValue = (1u << bitDepth) - 1;
+    return static_cast<CTF::pixel_t>(std::min(pixVal, maxValue) >> binShift);
+}
+
+
+//Number of threads to read images on, where 0 asks for the OpenMP default
+static int decodeThreadCount(size_t requested){
+#ifdef _OPENMP
+    return requested > 0 ? static_cast<int>(requested) : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+
+//Pick sample positions in a reference image, a CImg image or an ImageView, and extract its
+//values at them.  Positions are sorted by row.
+template<typename Image>
+static void sampleImage(const Image& ref,
+    CTFSolver::SamplingStrategy sampling, int maxValue, size_t numSamps, RandomGenerator& rng,
+    const std::vector<size_t>& channels, std::vector<SamplePos>& outPositions,
+    std::vector< std::vector<unsigned short> >& outValues, int& outWidth, int& outHeight)
+{
+    outWidth  = ref.width();
+    outHeight = ref.height();
+
+    //Generate vector of sample positions
+    //All channels are sampled at the same positions
+    switch(sampling){
+        case CTFSolver::RANDOM:
+            outPositions = genRandomSamples(outWidth, outHeight, numSamps, rng);
+            break;
+        case CTFSolver::STRATIFIED:
+            assert((size_t)ref.spectrum() > channels[0]);
+            outPositions = genStratifiedSamples(ref, channels[0], maxValue, numSamps, rng);
+            break;
+        default:
+            //This case should never occur, since the switch statement
+            //should be exhaustive for all possible sampling strategies
+            assert(false);
+            outPositions = genRandomSamples(outWidth, outHeight, numSamps, rng);
+            break;
+    }
+    assert(outPositions.size() == numSamps);
+
+    //Visit samples in memory order
+    std::sort(outPositions.begin(), outPositions.end());
+
+    extractSamples(ref, outPositions, channels, outValues);
+}
+
+
+/**
+ *  Pick sample positions in the reference image of a stack, at the pyramid level with
+ *  blockSize x blockSize blocks, and extract its values at them.  Positions are sorted
+ *  by row.
+ */
+template<typename T>
+static void sampleReference(const std::string& path, int blockSize,
+    CTFSolver::SamplingStrategy sampling, int maxValue, size_t numSamps, RandomGenerator& rng,
+    const std::vector<size_t>& channels, std::vector<SamplePos>& outPositions,
+    std::vector< std::vector<unsigned short> >& outValues, int& outWidth, int& outHeight)
+{
+    //8 bit PGM and PPM files are sampled in place at full resolution
+    MappedImage mapped;
+    if(blockSize == 1 && mapped.open(path)){
+        sampleImage(mapped.getView(), sampling, maxValue, numSamps, rng, channels,
+            outPositions, outValues, outWidth, outHeight);
+        return;
+    }
+
+    //Decode the reference image, at the pyramid level we sample from
+    CImg<T> ref(path.c_str());
+    if(blockSize > 1){
+        ref = boxDownsample(ref, blockSize);
+    }
+    sampleImage(ref, sampling, maxValue, numSamps, rng, channels,
+        outPositions, outValues, outWidth, outHeight);
+}
+
+
 CTFSolver::CTFSolver(const std::vector<ImageExposurePair>& images,
     size_t numSamps,
     CTF::ctf_t smoothingParam,
     size_t channel) :
     imdata(images), lambda(smoothingParam), chan(channel), numSamples(numSamps),
-    wFunc(HAT)
+    wFunc(HAT), solverType(SVD), sampling(STRATIFIED), seed(0), pyramidLevel(0),
+    monotonicityTolerance(-1), robustIterations(0), bitDepth(8), numBins(0),
+    tolerance(static_cast<CTF::ctf_t>(1e-6)), maxIterations(1000), polynomialDegree(3),
+    precision(MIXED), numDecodeThreads(0), useInitialCTF(false)
 {
-    assert(images.size() >= 2);
+    assert(!images.empty());
     //assert(numSamples > 256);
 }
 
@@ -138,17 +417,31 @@ CTFSolver::CTFSolver(const std::vector<ImageExposurePair>& images,
 bool CTFSolver::writePixelPoints(const std::vector<PixelResult>& pixels,
     std::ostream& os)const
 {
+    //Pixel values cached by the solver make reloading the images unnecessary
+    bool cached = true;
+    for(size_t i = 0; i < pixels.size(); i++){
+        cached = cached && pixels[i].pixelValues.size() == imdata.size();
+    }
+
     for(size_t j = 0; j < imdata.size(); j++){ //Loop over images
 
-        //Load current image
-        CImg<unsigned char> currIm(imdata[j].imagePath.c_str());
+        //Load current image, at the pyramid level the samples were taken from
+        CImg<unsigned short> currIm;
+        if(!cached){
+            currIm.load(imdata[j].imagePath.c_str());
+            if(pyramidLevel > 0){
+                currIm = boxDownsample(currIm, 1 << pyramidLevel);
+            }
+        }
 
         //Loop over samples
+        //Sample positions are the top left pixel of each sample's block
         for(size_t i = 0; i < pixels.size(); i++){
-            const int x = pixels[i].x;
-            const int y = pixels[i].y;
+            const int x = pixels[i].x >> pyramidLevel;
+            const int y = pixels[i].y >> pyramidLevel;
             const CTF::ctf_t irradiance = pixels[i].irradiance;
-            const unsigned char pixelValue = currIm(x,y,0,chan);
+            const CTF::pixel_t pixelValue = cached ? pixels[i].pixelValues[j] :
+                pixelLevel(currIm(x,y,0,chan), bitDepth, getBinShift());
             const CTF::ctf_t exposure = imdata[j].getTime() * irradiance;
             os << static_cast<int>(pixelValue) << "     " << exposure << std::endl;
         }
@@ -158,104 +451,144 @@ bool CTFSolver::writePixelPoints(const std::vector<PixelResult>& pixels,
     return os.good();
 }
 
-CTF CTFSolver::solve(std::vector<PixelResult>* retPixels)const{
+//Dense and sparse matrix types used by the linear solvers
+typedef Eigen::Matrix<CTF::ctf_t, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+typedef Eigen::Matrix<CTF::ctf_t, Eigen::Dynamic, 1> DenseVector;
+typedef Eigen::SparseMatrix<CTF::ctf_t, Eigen::RowMajor> SparseRowMatrix;
+typedef Eigen::SparseMatrix<CTF::ctf_t, Eigen::ColMajor> SparseColMatrix;
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> DoubleMatrix;
+typedef Eigen::Matrix<double, Eigen::Dynamic, 1> DoubleVector;
 
-    //n = 256 for 8 bit images
-    const int n = 256;
 
-    //Make a lookup table for our weighting function
-    //We don't care that we branch inside of the loop since this LUT is created once
-    CTF::ctf_t wLut[n];
-    for(int i = 0; i < n; i++){
-        CTF::ctf_t val = static_cast<CTF::ctf_t>(1.0);
-        const unsigned char pixVal = static_cast<unsigned char>(i);
-        switch(wFunc){
-            case HAT:
-                val = hatFunc(pixVal);
-                break;
-            case HAT_10:
-                val = hatFuncParameterized(pixVal, 10);
-                break;
-            default:
-                //This case should never occur, since the switch statement
-                //should be exhaustive for all possible weighting functions
-                assert(false);
-                val = hatFunc(pixVal);
-                break;
-        }
-        wLut[i] = val;
+//Settings of the solvers besides the smoothing value, gathered so they can be passed through
+//solveSystem(...)
+typedef struct SolverSettings{
+    CTF::ctf_t tolerance;
+    size_t maxIterations;
+    const CTF* initialCTF; //NULL for a cold start
+    size_t polynomialDegree;
+    CTFSolver::Precision precision;
+    CTFSolver::SystemStats* stats; //NULL unless stats are being collected
+}SolverSettings;
+
+
+/**
+ *  Add the time a stopwatch has measured to a stage.
+ */
+static void addStageTime(CTFSolver::StageTime& stage, const Stopwatch& watch){
+    stage.wallSeconds += watch.wallSeconds();
+    stage.cpuSeconds  += watch.cpuSeconds();
+}
+
+
+/**
+ *  Add the time of one stage to another.
+ */
+static void addStageTime(CTFSolver::StageTime& stage, const CTFSolver::StageTime& other){
+    stage.wallSeconds += other.wallSeconds;
+    stage.cpuSeconds  += other.cpuSeconds;
+}
+
+
+/**
+ *  If settings asks for stats, record the size of the system a solver built and the time
+ *  it took.  The stopwatch is restarted to time solving it.
+ */
+static void recordAssembly(const SolverSettings& settings, Stopwatch& watch, size_t rows,
+    size_t cols, size_t nonzeros)
+{
+    if(settings.stats != NULL){
+        addStageTime(settings.stats->assembly, watch);
+        settings.stats->rows     = rows;
+        settings.stats->cols     = cols;
+        settings.stats->nonzeros = nonzeros;
+    }
+    watch.restart();
+}
+
+
+/**
+ *  If settings asks for stats, record the time a solver took to solve its system.
+ */
+static void recordFactorization(const SolverSettings& settings, const Stopwatch& watch){
+    if(settings.stats != NULL){
+        addStageTime(settings.stats->factorization, watch);
     }
+}
 
-    //Find dimensions of first image
-    CImg<unsigned char> firstIm(imdata[0].imagePath.c_str());
-    const int firstWidth  = firstIm.width();
-    const int firstHeight = firstIm.height();
 
-    //Generate vector of random sample positions
-    std::vector<SamplePos> samplePositions = genRandomSamples(firstWidth, firstHeight, numSamples);
-    assert(samplePositions.size() == (size_t)numSamples);
+/**
+ *  Count the nonzero entries of a dense matrix.
+ */
+template<typename Scalar>
+static size_t countNonzeros(const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& M){
+    size_t count = 0;
+    for(int c = 0; c < M.cols(); c++){
+        for(int r = 0; r < M.rows(); r++){
+            count += M(r,c) != static_cast<Scalar>(0.0);
+        }
+    }
+    return count;
+}
+
 
-    //Allocate space for solving linear system
+/**
+ *  Solve the system from the Debevec and Malik paper using a dense matrix and a Jacobi SVD.
+ *  This is the method used in the paper.  Memory use is O(numSamples^2 * numImages), and
+ *  runtime is cubic, so this is only practical for small sample counts.
+ *
+ *  @return the vector of unknowns; the first n are the log CTF and the remainder are the
+ *   log irradiances of each sample.
+ */
+static DenseVector solveSVD(const CTFAccumulator& samples, CTF::ctf_t lambda, int n,
+    const SolverSettings& settings)
+{
+    Stopwatch watch(Stopwatch::THREAD);
+    const size_t numSamples = samples.getNumSamples();
 
     //Create left hand side matrix A in Ax=b
-    Eigen::Matrix<CTF::ctf_t, Eigen::Dynamic, Eigen::Dynamic> A(
-        numSamples * imdata.size() + n + 1, //rows
-        n + numSamples                      //columns
+    DenseMatrix A(
+        numSamples * samples.getNumExposures() + n + 1, //rows
+        n + numSamples                                  //columns
         );
+    A.setZero();
     //Right hand side vector
-    Eigen::Matrix<CTF::ctf_t, Eigen::Dynamic, Eigen::Dynamic> b(
-        numSamples * imdata.size() + n + 1, //rows
-        1
-    );
+    DenseVector b(numSamples * samples.getNumExposures() + n + 1);
+    b.setZero();
 
     //Populate the linear system
 
     //   Fitting equations
-    //   Note that the loop order here is reversed as compared to the Debevec paper to allow
-    //   us to load 1 image at a time and save memory
-    //   TODO: Catch loading errors
+    //   Note that the loop order here is reversed as compared to the Debevec paper to
+    //   match the order in which images are loaded
     int k = 0;
-    for(size_t j = 0; j < imdata.size(); j++){ //Loop over images
-
-        //Load current image
-        CImg<unsigned char> currIm(imdata[j].imagePath.c_str());
-        assert(currIm.width() == firstWidth);
-        assert(currIm.height() == firstHeight);
-        assert((size_t)currIm.spectrum() > chan);
-
+    for(size_t j = 0; j < samples.getNumExposures(); j++){ //Loop over images
         for(size_t i = 0; i < numSamples; i++){ //Loop over sample positions
-
-            //Get pixel value at current sample
-            const int x = samplePositions[i].x;
-            const int y = samplePositions[i].y;
-            const unsigned char pixVal = currIm(x,y,0,chan);
+            const CTF::pixel_t pixVal = samples.getPixelValue(i,j);
 
             //Get value of weighting function
-            const CTF::ctf_t w = wLut[pixVal];
+            const CTF::ctf_t w = samples.getWeight(pixVal) * samples.getSampleScale(i);
 
             //Update A matrix
             A(k,pixVal)  = w;
             A(k,n+i)     = -w;
 
             //Update RHS b vector
-            const CTF::ctf_t t = imdata[j].getTime();
-            assert(t > 0.0);
-
-            b(k,0)        = w * log(t);
+            b(k)         = w * samples.getLogTime(j);
 
             ++k;
         }
     }
 
-    //    Fix the curve
-    A(k++, 128) = static_cast<CTF::ctf_t>(1.0);
+    //    Fix the curve at the middle pixel value
+    A(k++, n/2) = static_cast<CTF::ctf_t>(1.0);
 
 
     //   Include regularization
-    for(int i = 0; i <= n-2; i++){
+    for(int i = 0; i <= n-3; i++){
         const int lval = i+1;
-        assert(lval >= 0 && lval <= 255);
-        const CTF::ctf_t w = wLut[lval];
+        assert(lval >= 0 && lval < n);
+        const CTF::ctf_t w = samples.getWeight(lval);
         A(k,i  ) = lambda * w;
         A(k,i+1) = -2.0 * lambda * w;
         A(k,i+2) = lambda * w;
@@ -264,36 +597,2261 @@ CTF CTFSolver::solve(std::vector<PixelResult>* retPixels)const{
     }
 
 
+    recordAssembly(settings, watch, A.rows(), A.cols(),
+        settings.stats != NULL ? countNonzeros(A) : 0);
+
     //At long last, solve the system
-    Eigen::Matrix<CTF::ctf_t, Eigen::Dynamic, Eigen::Dynamic> x = A.jacobiSvd(
+    const DenseVector x = A.jacobiSvd(
         //Only compute info needed for least squares solution
         Eigen::ComputeThinU | Eigen::ComputeThinV)
         .solve(b);
+    recordFactorization(settings, watch);
+    return x;
+}
 
-    //Transfer the results into a CTF
-    std::vector<CTF::ctf_t> results;
-    results.resize(n);
+
+/**
+ *  Compute the normal equations A^T A and A^T b for a sparse matrix A, one column at a
+ *  time, stored in the given scalar type.
+ *
+ *  Eigen's sparse * sparse product accumulates each result column in a sorted linked list,
+ *  which is quadratic in the number of nonzeros per column.  The CTF columns of A^T A couple
+ *  to every sample with that pixel value, so we use a dense scatter vector instead, and
+ *  accumulate in double precision since those columns sum many terms.
+ */
+template<typename Scalar>
+static void normalEquations(const SparseRowMatrix& A, const DenseVector& b,
+    Eigen::SparseMatrix<Scalar, Eigen::ColMajor>& AtA, Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& Atb)
+{
+    const SparseColMatrix Acol(A);
+    const int numCols = A.cols();
+
+    AtA.resize(numCols, numCols);
+    Atb.resize(numCols);
+    std::vector<double> accum(numCols, 0.0);
+    std::vector<bool>   touched(numCols, false);
+    std::vector<int>    pattern;
+    for(int c = 0; c < numCols; c++){
+
+        //Column c of A^T A is the sum of the rows of A that are nonzero in column c,
+        //scaled by that nonzero
+        pattern.clear();
+        double atb = 0.0;
+        for(SparseColMatrix::InnerIterator colIt(Acol,c); colIt; ++colIt){
+            const double a = colIt.value();
+            atb += a * b(colIt.row());
+            for(SparseRowMatrix::InnerIterator rowIt(A,colIt.row()); rowIt; ++rowIt){
+                const int i = rowIt.col();
+                if(!touched[i]){
+                    touched[i] = true;
+                    pattern.push_back(i);
+                }
+                accum[i] += a * rowIt.value();
+            }
+        }
+
+        //Gather the column in order and reset the scatter vector
+        std::sort(pattern.begin(), pattern.end());
+        AtA.startVec(c);
+        for(size_t p = 0; p < pattern.size(); p++){
+            const int i = pattern[p];
+            AtA.insertBack(i,c) = static_cast<Scalar>(accum[i]);
+            accum[i]   = 0.0;
+            touched[i] = false;
+        }
+        Atb(c) = static_cast<Scalar>(atb);
+    }
+    AtA.finalize();
+}
+
+
+/**
+ *  Solve S x = s with an LDLT factorization in the scalar type S is stored in.
+ */
+template<typename Scalar>
+static DenseVector solveLDLT(const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& S,
+    const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s)
+{
+    const Eigen::Matrix<Scalar, Eigen::Dynamic, 1> x = S.ldlt().solve(s);
+    return x.template cast<CTF::ctf_t>();
+}
+
+
+/**
+ *  Solve the double precision system S x = s by factoring a single precision copy of S,
+ *  then running conjugate gradients on S preconditioned by that factorization.  For well conditioned systems
+ *  this converges in a step or two, like iterative refinement, and it still converges for
+ *  condition numbers well past the 1e7 at which refinement stalls.  If it does not, S is
+ *  factored again in double precision instead.
+ *
+ *  The diagonal of S spans many orders of magnitude, since the weights of pixel values
+ *  near black and white are tiny, and LDLT drops pivots that small relative to the largest
+ *  one.  S is therefore scaled to a unit diagonal before it is factored.
+ */
+static DenseVector solveMixed(const DoubleMatrix& S, const DoubleVector& s){
+    const int MAX_ITERATIONS = 50;
+    const double TOLERANCE = 1e-10; //Residual, relative to s, to stop at
+
+    //Scale to a unit diagonal, solving (D S D) y = D s for x = D y
+    const int n = S.rows();
+    DoubleVector scale(n);
     for(int i = 0; i < n; i++){
-        results[i] = exp(x(i,0));
+        scale(i) = S(i,i) > 0.0 ? 1.0 / sqrt(S(i,i)) : 1.0;
     }
-    CTF ctf(results);
+    const DoubleMatrix Sd = scale.asDiagonal() * S * scale.asDiagonal();
+    const DoubleVector sd = scale.cwiseProduct(s);
+    const DenseMatrix Sf = Sd.cast<CTF::ctf_t>();
+    const Eigen::LDLT<DenseMatrix> ldlt(Sf);
+    const double stopNorm = TOLERANCE * sd.norm();
 
-    //Potentially extract the pixel values to verify quality of fit
-    const bool extractPoints = retPixels != NULL;
-    if(extractPoints){
-        assert(retPixels->empty());
+    //Preconditioned conjugate gradients, starting from the single precision solution
+    DenseVector vf = sd.cast<CTF::ctf_t>();
+    DoubleVector y = ldlt.solve(vf).cast<double>();
+    DoubleVector r = sd - Sd * y;
+    vf = r.cast<CTF::ctf_t>();
+    DoubleVector z = ldlt.solve(vf).cast<double>();
+    DoubleVector p = z;
+    double rz = r.dot(z);
+    for(int it = 0; it < MAX_ITERATIONS && r.norm() > stopNorm; it++){
+        const DoubleVector q = Sd * p;
+        const double pq = p.dot(q);
+        if(!(pq > 0.0 && rz > 0.0)){
+            break; //The single precision factorization is not positive definite
+        }
+        const double alpha = rz / pq;
+        y += alpha * p;
+        r -= alpha * q;
+
+        vf = r.cast<CTF::ctf_t>();
+        z = ldlt.solve(vf).cast<double>();
+        const double rzNext = r.dot(z);
+        p = z + (rzNext / rz) * p;
+        rz = rzNext;
+    }
+    if(r.norm() <= stopNorm){
+        const DoubleVector x = scale.cwiseProduct(y);
+        return x.cast<CTF::ctf_t>();
+    }
 
-        for(size_t i = n; i < n + numSamples; i++){
-           PixelResult curr;
-           curr.x = samplePositions[i-n].x;
-           curr.y = samplePositions[i-n].y;
-           curr.irradiance = exp(x(i,0));
-           retPixels->push_back(curr);
+    //Conjugate gradients did not converge
+    return solveLDLT(S, s);
+}
+
+
+/**
+ *  Solve the reduced n x n system S x = s for the log CTF, with the CTF fixed to 0 at
+ *  fixedIndex.  S and s are modified.  The smoothness term's condition number grows with
+ *  the fourth power of n, so long curves need more than single precision; the system must
+ *  already be assembled in double for that to help, see isDoubleSystem(...).  MIXED
+ *  solves with solveMixed(...), and SINGLE and DOUBLE factor S in the type it is stored in.
+ */
+template<typename Scalar>
+static DenseVector solveCurveSystem(Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& S,
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s, int fixedIndex, CTFSolver::Precision precision)
+{
+    S.row(fixedIndex).setZero();
+    S.col(fixedIndex).setZero();
+    S(fixedIndex, fixedIndex) = static_cast<Scalar>(1.0);
+    s(fixedIndex) = static_cast<Scalar>(0.0);
+
+    if(precision == CTFSolver::MIXED){
+        return solveMixed(S.template cast<double>(), s.template cast<double>());
+    }
+    return solveLDLT(S, s);
+}
+
+
+//Most CTF unknowns a reduced curve system assembled and solved in CTF::ctf_t stays accurate for
+static const int MAX_SINGLE_LEVELS = 256;
+
+
+/**
+ *  Should the reduced curve system for n CTF unknowns be assembled in double rather than
+ *  CTF::ctf_t?  Each sample's elimination subtracts terms that nearly cancel the ones just
+ *  added, so a system assembled in single precision is already too inaccurate for a double
+ *  solve to recover long curves.  SINGLE assembles in CTF::ctf_t up to MAX_SINGLE_LEVELS
+ *  unknowns, and in double beyond that, where it then also factors in double.  MIXED and
+ *  DOUBLE always assemble in double.
+ */
+static bool isDoubleSystem(CTFSolver::Precision precision, int n){
+    return precision != CTFSolver::SINGLE || n > MAX_SINGLE_LEVELS;
+}
+
+
+/**
+ *  Add the normal equations of the smoothness term, lambda * w(z) * g''(z) = 0, to the
+ *  reduced n x n system S for the CTF unknowns.
+ */
+template<typename Scalar>
+static void addSmoothnessTerm(Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& S,
+    const CTF::ctf_t* wLut, CTF::ctf_t lambda, int n)
+{
+    for(int i = 0; i <= n-3; i++){
+        const Scalar w = static_cast<Scalar>(lambda) * wLut[i+1];
+        const Scalar coeffs[3] = {w, -2 * w, w};
+        for(int p = 0; p < 3; p++){
+            for(int q = 0; q < 3; q++){
+                S(i+p, i+q) += coeffs[p] * coeffs[q];
+            }
         }
     }
+}
 
-    //All done
-    return ctf;
+
+/**
+ *  Solve the normal equations (A^T A) x = A^T b of the Debevec and Malik system via
+ *  a Cholesky factorization.
+ *
+ *  Each sample's irradiance unknown only appears in that sample's own fitting equations,
+ *  so the lower right (sample x sample) block of A^T A is diagonal.  Eliminating those
+ *  unknowns first therefore causes no fill-in, and leaves a dense n x n system for the
+ *  CTF unknowns that is factored with LDLT.  Samples with zero total weight are not
+ *  constrained by the system and get a log irradiance of 0.
+ *
+ *  The system is only determined up to a constant offset of all unknowns, which the paper
+ *  removes with an extra equation fixing the curve at 1 pixel value.  That equation is far
+ *  too weak relative to the fitting equations to survive squaring the system in single
+ *  precision, so the fixed unknown is instead eliminated exactly here.
+ *
+ *  The normal equations, and the reduced system built from them, are stored in the scalar
+ *  type Scalar, see isDoubleSystem(...).
+ *
+ *  @param AtA is the (n + numSamples) square normal matrix.
+ *  @param Atb is the right hand side of the normal equations.
+ *  @param n is the number of CTF unknowns.
+ *  @param fixedIndex is the index of the CTF unknown that is fixed to 0.
+ *  @param precision is the precision of the reduced solve, see solveCurveSystem(...).
+ */
+template<typename Scalar>
+static DenseVector sparseCholeskySolve(const Eigen::SparseMatrix<Scalar, Eigen::ColMajor>& AtA,
+    const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& Atb, int n, int fixedIndex,
+    CTFSolver::Precision precision)
+{
+    typedef Eigen::SparseMatrix<Scalar, Eigen::ColMajor> Sparse;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+    const int numUnknowns = AtA.cols();
+    assert(AtA.rows() == numUnknowns);
+    assert(Atb.rows() == numUnknowns);
+
+    //Reduced system for the CTF unknowns
+    Matrix S(n,n);
+    S.setZero();
+    Vector s = Atb.head(n);
+
+    //Inverse of each diagonal entry of the sample block; 0 marks an unconstrained sample
+    Vector dInv(numUnknowns - n);
+    dInv.setZero();
+
+    //Scratch space for the coupling entries of a single sample column
+    std::vector<int> rows;
+    std::vector<Scalar> vals;
+
+    for(int c = 0; c < numUnknowns; c++){
+        if(c < n){
+            //CTF column; copy the dense n x n block
+            for(typename Sparse::InnerIterator it(AtA,c); it; ++it){
+                if(it.row() < n){
+                    S(it.row(), c) += it.value();
+                }
+            }
+            continue;
+        }
+
+        //Sample column; gather the diagonal entry and the coupling to the CTF unknowns
+        rows.clear();
+        vals.clear();
+        Scalar d = static_cast<Scalar>(0.0);
+        for(typename Sparse::InnerIterator it(AtA,c); it; ++it){
+            if(it.row() == c){
+                d = it.value();
+            }else{
+                assert(it.row() < n); //Sample block must be diagonal
+                rows.push_back(it.row());
+                vals.push_back(it.value());
+            }
+        }
+        if(d <= static_cast<Scalar>(0.0)){
+            continue;
+        }
+        const Scalar di = static_cast<Scalar>(1.0) / d;
+        dInv(c-n) = di;
+
+        //Schur complement update S -= e e^T / d, s -= e * Atb(c) / d
+        for(size_t p = 0; p < rows.size(); p++){
+            for(size_t q = 0; q < rows.size(); q++){
+                S(rows[p], rows[q]) -= vals[p] * vals[q] * di;
+            }
+            s(rows[p]) -= vals[p] * Atb(c) * di;
+        }
+    }
+
+    //Solve for the CTF unknowns
+    DenseVector x(numUnknowns);
+    x.head(n) = solveCurveSystem(S, s, fixedIndex, precision);
+
+    //Back substitute for the sample unknowns
+    for(int c = n; c < numUnknowns; c++){
+        const Scalar di = dInv(c-n);
+        if(di == static_cast<Scalar>(0.0)){
+            x(c) = static_cast<CTF::ctf_t>(0.0);
+            continue;
+        }
+        Scalar r = Atb(c);
+        for(typename Sparse::InnerIterator it(AtA,c); it; ++it){
+            if(it.row() < n){
+                r -= it.value() * x(it.row());
+            }
+        }
+        x(c) = static_cast<CTF::ctf_t>(r * di);
+    }
+
+    return x;
+}
+
+
+/**
+ *  Solve the system from the Debevec and Malik paper using sparse matrices.  Each fitting
+ *  equation has 2 nonzeros and each smoothness equation has 3, so A is stored in
+ *  O(numSamples * numImages) memory and the normal equations are solved with
+ *  sparseCholeskySolve(...).
+ *
+ *  @return the vector of unknowns; the first n are the log CTF and the remainder are the
+ *   log irradiances of each sample.
+ */
+static DenseVector solveSparseCholesky(const CTFAccumulator& samples, CTF::ctf_t lambda, int n,
+    const SolverSettings& settings)
+{
+    Stopwatch watch(Stopwatch::THREAD);
+    const size_t numSamples = samples.getNumSamples();
+    const int numRows = numSamples * samples.getNumExposures() + n - 2;
+
+    //Create left hand side matrix A in Ax=b
+    //Rows are filled in order, and within a row columns are filled in increasing order,
+    //so we can use Eigen's coherent insertion API
+    SparseRowMatrix A(numRows, n + numSamples);
+    A.reserve(2 * numSamples * samples.getNumExposures() + 3 * n);
+    //Right hand side vector
+    DenseVector b(numRows);
+    b.setZero();
+
+    //   Fitting equations
+    int k = 0;
+    for(size_t j = 0; j < samples.getNumExposures(); j++){ //Loop over images
+        for(size_t i = 0; i < numSamples; i++){ //Loop over sample positions
+            const CTF::pixel_t pixVal = samples.getPixelValue(i,j);
+            const CTF::ctf_t w = samples.getWeight(pixVal) * samples.getSampleScale(i);
+
+            A.startVec(k);
+            if(w != static_cast<CTF::ctf_t>(0.0)){
+                A.insertBack(k, pixVal) = w;
+                A.insertBack(k, n+i)    = -w;
+                b(k) = w * samples.getLogTime(j);
+            }
+
+            ++k;
+        }
+    }
+
+    //   Include regularization
+    //   The curve is fixed at n/2 by sparseCholeskySolve(...) rather than by an equation
+    for(int i = 0; i <= n-3; i++){
+        const CTF::ctf_t w = samples.getWeight(i+1);
+
+        A.startVec(k);
+        if(w != static_cast<CTF::ctf_t>(0.0)){
+            A.insertBack(k,i  ) = lambda * w;
+            A.insertBack(k,i+1) = -2.0 * lambda * w;
+            A.insertBack(k,i+2) = lambda * w;
+        }
+
+        ++k;
+    }
+    assert(k == numRows);
+    A.finalize();
+
+    //Form the normal equations and solve
+    DenseVector x;
+    if(isDoubleSystem(settings.precision, n)){
+        Eigen::SparseMatrix<double, Eigen::ColMajor> AtA;
+        DoubleVector Atb;
+        normalEquations(A, b, AtA, Atb);
+        recordAssembly(settings, watch, A.rows(), A.cols(), A.nonZeros());
+        x = sparseCholeskySolve(AtA, Atb, n, n/2, settings.precision);
+    }else{
+        SparseColMatrix AtA;
+        DenseVector Atb;
+        normalEquations(A, b, AtA, Atb);
+        recordAssembly(settings, watch, A.rows(), A.cols(), A.nonZeros());
+        x = sparseCholeskySolve(AtA, Atb, n, n/2, settings.precision);
+    }
+    recordFactorization(settings, watch);
+    return x;
+}
+
+
+/**
+ *  Add the fitting equations of some samples to the reduced n x n system S s for the CTF
+ *  unknowns, eliminating each sample's irradiance unknown on the way.  Samples first,
+ *  first + stride, first + 2*stride, ... are added.
+ *
+ *  Eliminating a sample leaves a term coupling every pair of pixel values the sample took,
+ *  and a sample only takes a few distinct pixel values, so this is cheap.  S and s may be
+ *  stored in float or double, see isDoubleSystem(...).  The sample's own diagonal entry and
+ *  right hand side are summed again here in that type, rather than taken from the
+ *  accumulator, so that each elimination cancels the terms it should to the last bit.
+ */
+template<typename Scalar>
+static void addReducedDataTerm(const CTFAccumulator& system, size_t first, size_t stride,
+    Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& S,
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s)
+{
+    //Scratch space for the pixel values of a single sample, and the squared weight and the
+    //squared weight times log time summed over each of them
+    std::vector<int> vals;
+    std::vector<Scalar> w2Sums;
+    std::vector<Scalar> w2TimeSums;
+
+    for(size_t i = first; i < system.getNumSamples(); i += stride){ //Loop over sample positions
+        if(system.getSampleDiagonal(i) == static_cast<CTF::ctf_t>(0.0)){
+            continue;
+        }
+
+        //Gather the coupling between this sample and the CTF unknowns
+        vals.clear();
+        w2Sums.clear();
+        w2TimeSums.clear();
+        const Scalar mult = system.getSampleMultiplicity(i);
+        Scalar d = static_cast<Scalar>(0.0);
+        Scalar r = static_cast<Scalar>(0.0);
+        for(size_t j = 0; j < system.getNumExposures(); j++){ //Loop over images
+            const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+            const Scalar w = system.getWeight(pixVal);
+            if(w == static_cast<Scalar>(0.0)){
+                continue;
+            }
+
+            const size_t p = std::find(vals.begin(), vals.end(), pixVal) - vals.begin();
+            if(p == vals.size()){
+                vals.push_back(pixVal);
+                w2Sums.push_back(static_cast<Scalar>(0.0));
+                w2TimeSums.push_back(static_cast<Scalar>(0.0));
+            }
+            const Scalar w2 = mult * w * w;
+            w2Sums[p]     += w2;
+            w2TimeSums[p] += w2 * system.getLogTime(j);
+        }
+        for(size_t p = 0; p < vals.size(); p++){
+            d += w2Sums[p];
+            r += w2TimeSums[p];
+        }
+
+        //Add the CTF block, then eliminate the irradiance unknown
+        const Scalar di = static_cast<Scalar>(1.0) / d;
+        for(size_t p = 0; p < vals.size(); p++){
+            S(vals[p], vals[p]) += w2Sums[p];
+            s(vals[p])          += w2TimeSums[p];
+            for(size_t q = 0; q < vals.size(); q++){
+                S(vals[p], vals[q]) -= w2Sums[p] * w2Sums[q] * di;
+            }
+            s(vals[p]) -= w2Sums[p] * r * di;
+        }
+    }
+}
+
+
+/**
+ *  Get the log irradiance of sample i that best fits its pixel values for the log CTF g,
+ *  which is the weighted mean of g(Z) - log(t) over its exposures.  Samples with zero total
+ *  weight are not constrained and get 0.
+ */
+static CTF::ctf_t sampleLogIrradiance(const CTFAccumulator& system, size_t i, const DenseVector& g){
+    const CTF::ctf_t d = system.getSampleDiagonal(i);
+    if(d == static_cast<CTF::ctf_t>(0.0)){
+        return static_cast<CTF::ctf_t>(0.0);
+    }
+
+    CTF::ctf_t num = static_cast<CTF::ctf_t>(0.0);
+    for(size_t j = 0; j < system.getNumExposures(); j++){
+        const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+        num += system.getWeight(pixVal) * system.getWeight(pixVal) * g(pixVal);
+    }
+    return (system.getSampleMultiplicity(i) * num - system.getSampleRHS(i)) / d;
+}
+
+
+/**
+ *  Count the fitting equations of a system with nonzero weight.
+ */
+static size_t countFittingEquations(const CTFAccumulator& system){
+    size_t count = 0;
+    for(size_t i = 0; i < system.getNumSamples(); i++){
+        for(size_t j = 0; j < system.getNumExposures(); j++){
+            count += system.getWeight(system.getPixelValue(i,j)) != static_cast<CTF::ctf_t>(0.0);
+        }
+    }
+    return count;
+}
+
+
+/**
+ *  Fill in the fit diagnostics of stats for the log CTF g of a system.  Residuals are RMS
+ *  over the equations with nonzero weight, with each sample at its best fit irradiance and
+ *  merged samples counted once per original sample.  The system is underdetermined, as in
+ *  Debevec and Malik, when its samples give fewer fitting equations, less one per sample
+ *  for its irradiance, than there are weighted levels less one for the fixed level.  The
+ *  smoothness term dominates when it leaves more squared error than the fitting term, so
+ *  the curve is bent away from the data rather than just kept smooth between samples.
+ */
+static void computeFitStats(const CTFAccumulator& system, const DenseVector& g,
+    CTF::ctf_t lambda, int n, CTFSolver::SystemStats& stats)
+{
+    //   Fitting equations
+    double fitSum = 0.0, fitCount = 0.0, independent = 0.0;
+    std::vector<bool> taken(n, false);
+    for(size_t i = 0; i < system.getNumSamples(); i++){
+        if(system.getSampleDiagonal(i) == static_cast<CTF::ctf_t>(0.0)){
+            continue;
+        }
+        const double logIrradiance = sampleLogIrradiance(system, i, g);
+        const double mult = system.getSampleMultiplicity(i);
+        size_t numEquations = 0;
+        for(size_t j = 0; j < system.getNumExposures(); j++){
+            const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+            const double w = system.getWeight(pixVal);
+            if(w == 0.0){
+                continue;
+            }
+            const double e = w * (g(pixVal) - logIrradiance - system.getLogTime(j));
+            fitSum    += mult * e * e;
+            fitCount  += mult;
+            taken[pixVal] = true;
+            ++numEquations;
+        }
+        independent += mult * (numEquations - 1);
+    }
+    stats.fitResidual = fitCount > 0.0 ? sqrt(fitSum / fitCount) : 0.0;
+
+    //   Smoothness equations
+    double smoothSum = 0.0;
+    for(int i = 0; i <= n-3; i++){
+        const double w = lambda * system.getWeight(i+1);
+        const double e = w * (g(i) - 2.0 * g(i+1) + g(i+2));
+        smoothSum += e * e;
+    }
+    stats.smoothnessResidual = n > 2 ? sqrt(smoothSum / (n - 2)) : 0.0;
+
+    //Levels that only the smoothness term determines
+    size_t numWeighted = 0;
+    stats.levelsWithoutData = 0;
+    for(int z = 0; z < n; z++){
+        if(system.getWeight(z) != static_cast<CTF::ctf_t>(0.0)){
+            ++numWeighted;
+            stats.levelsWithoutData += !taken[z];
+        }
+    }
+    stats.underdetermined = independent < static_cast<double>(numWeighted) - 1.0;
+    stats.smoothnessDominates = smoothSum > fitSum;
+}
+
+
+/**
+ *  Estimate the 2-norm condition number of the symmetric positive definite matrix S with
+ *  row and column fixedIndex left out, by power iteration for its largest eigenvalue and
+ *  inverse iteration for its smallest.  Singular matrices give infinity.
+ */
+template<typename Scalar>
+static double estimateConditionNumber(const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& S,
+    int fixedIndex)
+{
+    const int NUM_ITERATIONS = 30;
+
+    const int m = S.rows() - 1;
+    DoubleMatrix A(m,m);
+    for(int p = 0; p < m; p++){
+        const int pp = p < fixedIndex ? p : p + 1;
+        for(int q = 0; q < m; q++){
+            A(p,q) = S(pp, q < fixedIndex ? q : q + 1);
+        }
+    }
+
+    const double INF = std::numeric_limits<double>::infinity();
+
+    DoubleVector v = DoubleVector::Ones(m).normalized();
+    double largest = 0.0;
+    for(int it = 0; it < NUM_ITERATIONS; it++){
+        const DoubleVector w = A * v;
+        largest = w.norm();
+        if(!(largest > 0.0)){
+            return INF;
+        }
+        v = w / largest;
+    }
+
+    const Eigen::LDLT<DoubleMatrix> ldlt(A);
+    v = DoubleVector::Ones(m).normalized();
+    double inverseSmallest = 0.0;
+    for(int it = 0; it < NUM_ITERATIONS; it++){
+        const DoubleVector w = ldlt.solve(v);
+        inverseSmallest = w.norm();
+        if(!(inverseSmallest > 0.0 && inverseSmallest < INF)){
+            return INF;
+        }
+        v = w / inverseSmallest;
+    }
+
+    return largest * inverseSmallest;
+}
+
+
+/**
+ *  Record the size and condition number of a reduced n x n curve system, for solvers that
+ *  build it directly, and the time that took.  Residuals are not known and are set to -1.
+ */
+template<typename Scalar>
+static void recordCurveSystemStats(const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& S,
+    CTFSolver::SystemStats& stats, CTFSolver::StageTime& diagnostics)
+{
+    Stopwatch watch;
+    stats.rows     = S.rows();
+    stats.cols     = S.cols();
+    stats.nonzeros = countNonzeros(S);
+    stats.conditionNumber    = estimateConditionNumber(S, S.rows()/2);
+    stats.fitResidual        = -1.0;
+    stats.smoothnessResidual = -1.0;
+    addStageTime(diagnostics, watch);
+}
+
+
+/**
+ *  Solve the system from the Debevec and Malik paper without ever forming it.
+ *
+ *  This is the same elimination performed by sparseCholeskySolve(...), but the reduced
+ *  n x n system for the CTF unknowns is built directly from the normal equations in the
+ *  accumulator, one sample at a time, so memory and solve cost do not depend on the number
+ *  of samples.  Each sample's log irradiance is the weighted mean of g(Z) - log(t) over its
+ *  exposures, and is only computed if solveIrradiances is true.
+ *
+ *  The reduced system is assembled in the scalar type Scalar, see isDoubleSystem(...).
+ *
+ *  @return the vector of unknowns; the first n are the log CTF and, if solveIrradiances is
+ *   true, the remainder are the log irradiances of each sample.
+ */
+template<typename Scalar>
+static DenseVector solveSchurAs(const CTFAccumulator& system, CTF::ctf_t lambda, int n,
+    bool solveIrradiances, const SolverSettings& settings)
+{
+    Stopwatch watch(Stopwatch::THREAD);
+    const size_t numSamples = system.getNumSamples();
+
+    //Reduced system for the CTF unknowns
+    Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> S(n,n);
+    S.setZero();
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1> s(n);
+    s.setZero();
+
+    //   Fitting equations
+    addReducedDataTerm(system, 0, 1, S, s);
+
+    //   Include regularization
+    addSmoothnessTerm(S, system.getWeightLUT(), lambda, n);
+    recordAssembly(settings, watch, n, n, settings.stats != NULL ? countNonzeros(S) : 0);
+
+    //Solve for the CTF unknowns
+    DenseVector x(solveIrradiances ? n + numSamples : n);
+    x.head(n) = solveCurveSystem(S, s, n/2, settings.precision);
+    recordFactorization(settings, watch);
+
+    //Back substitute for the sample unknowns
+    if(solveIrradiances){
+        const DenseVector g = x.head(n);
+        for(size_t i = 0; i < numSamples; i++){
+            x(n+i) = sampleLogIrradiance(system, i, g);
+        }
+    }
+
+    return x;
+}
+
+
+/**
+ *  Solve with solveSchurAs(...), assembling in the scalar type settings asks for.
+ */
+static DenseVector solveSchur(const CTFAccumulator& system, CTF::ctf_t lambda, int n,
+    bool solveIrradiances, const SolverSettings& settings)
+{
+    if(isDoubleSystem(settings.precision, n)){
+        return solveSchurAs<double>(system, lambda, n, solveIrradiances, settings);
+    }
+    return solveSchurAs<CTF::ctf_t>(system, lambda, n, solveIrradiances, settings);
+}
+
+
+/**
+ *  Resample a log curve with m entries to numLevels entries, and get entry k.  Entries
+ *  cover equal ranges of pixel values, so entry k sits at (k + 0.5) * m / numLevels - 0.5
+ *  in the original curve.  It is interpolated linearly between the entries around it, and
+ *  held at the end entries past either end.  With numLevels = m, entry k is unchanged.
+ */
+static CTF::ctf_t resampleLogCurve(const std::vector<CTF::ctf_t>& logCurve, size_t k,
+    size_t numLevels)
+{
+    const size_t m = logCurve.size();
+    const double pos = (k + 0.5) * m / numLevels - 0.5;
+    if(pos <= 0.0){
+        return logCurve[0];
+    }
+    const size_t lo = static_cast<size_t>(pos);
+    if(lo + 1 >= m){
+        return logCurve[m-1];
+    }
+    const double frac = pos - lo;
+    return static_cast<CTF::ctf_t>((1.0 - frac) * logCurve[lo] + frac * logCurve[lo+1]);
+}
+
+
+/**
+ *  Make a CTF with numLevels entries from the first n unknowns of a solution, which are
+ *  the log CTF.  When several pixel values share each unknown, the curve is interpolated
+ *  between the unknowns, see resampleLogCurve(...).
+ */
+static CTF curveFromSolution(const DenseVector& x, int n, size_t numLevels){
+    std::vector<CTF::ctf_t> logCurve(n);
+    for(int i = 0; i < n; i++){
+        logCurve[i] = x(i);
+    }
+
+    std::vector<CTF::ctf_t> results;
+    results.resize(numLevels);
+    for(size_t i = 0; i < numLevels; i++){
+        results[i] = exp(resampleLogCurve(logCurve, i, numLevels));
+    }
+    return CTF(results);
+}
+
+
+/**
+ *  Scale a smoothing value for a curve with n unknowns.  A smooth curve's second
+ *  differences shrink with the square of the spacing between unknowns, and there are more
+ *  of them, so lambda is scaled by ((n-1)/255)^1.5 to penalize a curve about as much as
+ *  with the 256 unknowns of an 8 bit sensor.  This keeps smoothing values comparable
+ *  across bit depths and bin counts.
+ */
+static CTF::ctf_t levelLambda(CTF::ctf_t lambda, int n){
+    return n == 256 ? lambda : static_cast<CTF::ctf_t>(lambda * pow((n - 1) / 255.0, 1.5));
+}
+
+
+/**
+ *  Apply the preconditioned Debevec and Malik system matrix, y = A D x, without forming A.
+ *  The unknowns are the n log CTF values followed by the sample log irradiances, and D is
+ *  the diagonal column scaling.  Rows are the fitting equations of every sample in every
+ *  exposure followed by the smoothness equations.
+ */
+static void applySystem(const CTFAccumulator& system, CTF::ctf_t lambda, int n,
+    const Eigen::VectorXd& colScale, const Eigen::VectorXd& x, Eigen::VectorXd& y)
+{
+    const size_t numSamples = system.getNumSamples();
+
+    //   Fitting equations
+    size_t k = 0;
+    for(size_t j = 0; j < system.getNumExposures(); j++){ //Loop over images
+        for(size_t i = 0; i < numSamples; i++){ //Loop over sample positions
+            const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+            const double w = system.getWeight(pixVal) * system.getSampleScale(i);
+            y(k++) = w * (colScale(pixVal) * x(pixVal) - colScale(n+i) * x(n+i));
+        }
+    }
+
+    //   Smoothness equations
+    for(int i = 0; i <= n-3; i++){
+        const double w = lambda * system.getWeight(i+1);
+        y(k++) = w * (colScale(i) * x(i) - 2.0 * colScale(i+1) * x(i+1) +
+            colScale(i+2) * x(i+2));
+    }
+}
+
+
+/**
+ *  Apply the transpose of the preconditioned system matrix, x = D A^T y.
+ */
+static void applySystemTranspose(const CTFAccumulator& system, CTF::ctf_t lambda, int n,
+    const Eigen::VectorXd& colScale, const Eigen::VectorXd& y, Eigen::VectorXd& x)
+{
+    const size_t numSamples = system.getNumSamples();
+    x.setZero();
+
+    //   Fitting equations
+    size_t k = 0;
+    for(size_t j = 0; j < system.getNumExposures(); j++){ //Loop over images
+        for(size_t i = 0; i < numSamples; i++){ //Loop over sample positions
+            const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+            const double wy = system.getWeight(pixVal) * system.getSampleScale(i) * y(k++);
+            x(pixVal) += wy;
+            x(n+i)    -= wy;
+        }
+    }
+
+    //   Smoothness equations
+    for(int i = 0; i <= n-3; i++){
+        const double wy = lambda * system.getWeight(i+1) * y(k++);
+        x(i)   += wy;
+        x(i+1) -= 2.0 * wy;
+        x(i+2) += wy;
+    }
+
+    x = x.cwiseProduct(colScale);
+}
+
+
+/**
+ *  Solve the system from the Debevec and Malik paper iteratively with conjugate gradients on
+ *  the normal equations(CGLS), without forming the system matrix.  Memory use is linear in
+ *  the number of samples.
+ *
+ *  Each column of the system is scaled to unit norm(Jacobi preconditioning), which matters
+ *  because the CTF columns collect the weight of many samples and the sample columns only
+ *  a few.  The CTF is fixed at n/2 by dropping that column, and columns that appear in no
+ *  equation keep their starting value.  Iteration starts from settings.initialCTF,
+ *  resampled to n entries, or a constant curve without one, with each sample at its best
+ *  fit irradiance for that curve.
+ *  It stops once |D A^T r| <= tolerance * |D A^T b|, where r is the residual, so a good
+ *  starting curve needs few iterations.  Sums are accumulated in double precision.
+ *
+ *  @return the vector of unknowns; the first n are the log CTF and, if solveIrradiances is
+ *   true, the remainder are the log irradiances of each sample.
+ */
+static DenseVector solveIterative(const CTFAccumulator& system, CTF::ctf_t lambda, int n,
+    bool solveIrradiances, const SolverSettings& settings, CTFSolver::ConvergenceInfo* info)
+{
+    Stopwatch watch(Stopwatch::THREAD);
+    const size_t numSamples = system.getNumSamples();
+    const size_t numCols = n + numSamples;
+    const size_t numRows = numSamples * system.getNumExposures() + n - 2;
+
+    //Scale each column to unit norm
+    Eigen::VectorXd colScale(numCols);
+    for(int z = 0; z < n; z++){
+        colScale(z) = system.getCurveDiagonal(z);
+    }
+    for(int i = 0; i <= n-3; i++){
+        const double w = lambda * system.getWeight(i+1);
+        colScale(i)   += w * w;
+        colScale(i+1) += 4.0 * w * w;
+        colScale(i+2) += w * w;
+    }
+    for(size_t i = 0; i < numSamples; i++){
+        colScale(n+i) = system.getSampleDiagonal(i);
+    }
+    for(size_t c = 0; c < numCols; c++){
+        colScale(c) = colScale(c) > 0.0 ? 1.0 / sqrt(colScale(c)) : 0.0;
+    }
+    colScale(n/2) = 0.0; //Fixes the curve at n/2
+
+    //Starting point, with the curve shifted to be 0 at n/2
+    DenseVector start(numCols);
+    start.head(n).setZero();
+    if(settings.initialCTF != NULL){
+        const CTF& init = *(settings.initialCTF);
+        std::vector<CTF::ctf_t> logInit(init.getNumLevels());
+        for(size_t z = 0; z < logInit.size(); z++){
+            logInit[z] = log(init.at(z));
+        }
+        const CTF::ctf_t offset = resampleLogCurve(logInit, n/2, n);
+        for(int z = 0; z < n; z++){
+            start(z) = resampleLogCurve(logInit, z, n) - offset;
+        }
+    }
+    const DenseVector startCurve = start.head(n);
+    for(size_t i = 0; i < numSamples; i++){
+        start(n+i) = sampleLogIrradiance(system, i, startCurve);
+    }
+
+    //Right hand side
+    Eigen::VectorXd b(numRows);
+    b.setZero();
+    size_t k = 0;
+    for(size_t j = 0; j < system.getNumExposures(); j++){ //Loop over images
+        for(size_t i = 0; i < numSamples; i++){ //Loop over sample positions
+            const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+            b(k++) = system.getWeight(pixVal) * system.getSampleScale(i) * system.getLogTime(j);
+        }
+    }
+
+    //Work in the scaled unknowns x = D^-1 * unknowns; unscaled columns keep their start value
+    //in fixedPart, which is moved to the right hand side
+    Eigen::VectorXd x(numCols), fixedPart(numCols), ones(numCols);
+    for(size_t c = 0; c < numCols; c++){
+        x(c)         = colScale(c) > 0.0 ? start(c) / colScale(c) : 0.0;
+        fixedPart(c) = colScale(c) > 0.0 ? 0.0 : start(c);
+        ones(c)      = 1.0;
+    }
+    Eigen::VectorXd q(numRows);
+    applySystem(system, lambda, n, ones, fixedPart, q);
+    b -= q;
+    recordAssembly(settings, watch, numRows, numCols,
+        settings.stats != NULL ? 2 * countFittingEquations(system) + 3 * (n-2) : 0);
+
+    //CGLS
+    Eigen::VectorXd r(numRows), s(numCols), p(numCols);
+    applySystem(system, lambda, n, colScale, x, q);
+    r = b - q;
+    applySystemTranspose(system, lambda, n, colScale, b, s);
+    const double stopNorm = settings.tolerance * s.norm();
+    applySystemTranspose(system, lambda, n, colScale, r, s);
+    p = s;
+    double gamma = s.squaredNorm();
+    size_t iter = 0;
+    while(sqrt(gamma) > stopNorm && iter < settings.maxIterations){
+        applySystem(system, lambda, n, colScale, p, q);
+        const double qq = q.squaredNorm();
+        if(qq == 0.0){
+            break;
+        }
+        const double alpha = gamma / qq;
+        x += alpha * p;
+        r -= alpha * q;
+        applySystemTranspose(system, lambda, n, colScale, r, s);
+        const double gammaNext = s.squaredNorm();
+        p = s + (gammaNext / gamma) * p;
+        gamma = gammaNext;
+        ++iter;
+    }
+
+    if(info != NULL){
+        info->iterations = iter;
+        info->residual   = stopNorm > 0.0 ?
+            static_cast<CTF::ctf_t>(sqrt(gamma) * settings.tolerance / stopNorm) :
+            static_cast<CTF::ctf_t>(0.0);
+        info->converged  = sqrt(gamma) <= stopNorm;
+    }
+    recordFactorization(settings, watch);
+
+    //Undo the scaling
+    DenseVector ret(solveIrradiances ? numCols : n);
+    for(size_t c = 0; c < (size_t)ret.size(); c++){
+        ret(c) = static_cast<CTF::ctf_t>(colScale(c) * x(c) + fixedPart(c));
+    }
+    return ret;
+}
+
+
+//Number of bins a coarse curve for warm starting the ITERATIVE solver is solved on
+static const int COARSE_LEVELS = 256;
+
+
+/**
+ *  Solve a system with more than COARSE_LEVELS CTF unknowns on COARSE_LEVELS bins of them
+ *  with the SCHUR solver, giving a cheap approximation of its curve.  Each bin gets the
+ *  mean weight of the unknowns it covers.
+ */
+static CTF solveCoarse(const CTFAccumulator& system, CTF::ctf_t lambda, int n,
+    const SolverSettings& settings)
+{
+    int shift = 0;
+    while((n >> shift) > COARSE_LEVELS){
+        ++shift;
+    }
+    const int m = n >> shift;
+
+    std::vector<CTF::ctf_t> coarseLut(m, static_cast<CTF::ctf_t>(0.0));
+    for(int z = 0; z < n; z++){
+        coarseLut[z >> shift] += system.getWeight(z) / (1 << shift);
+    }
+    const CTFAccumulator coarse = system.rebinned(shift, &(coarseLut[0]));
+    const CTF::ctf_t coarseLambda =
+        static_cast<CTF::ctf_t>(lambda * pow((m - 1.0) / (n - 1.0), 1.5));
+    return curveFromSolution(solveSchur(coarse, coarseLambda, m, false, settings), m, m);
+}
+
+
+//Typedefs for the small double precision systems of the polynomial solver
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> PolyMatrix;
+typedef Eigen::Matrix<double, Eigen::Dynamic, 1> PolyVector;
+
+
+/**
+ *  Evaluate the polynomial with the given coefficients, lowest order first, at M.
+ */
+static inline double evalPolynomial(const PolyVector& c, double M){
+    double p = 0.0;
+    for(int e = static_cast<int>(c.size()) - 1; e >= 0; e--){ //Horner's rule
+        p = p * M + c(e);
+    }
+    return p;
+}
+
+
+/**
+ *  Add the normal equations of the Mitsunaga and Nayar fitting equations of a system to
+ *  N and r, for a polynomial inverse response of the given degree.
+ *
+ *  The inverse response p(M) = c_0 + c_1 M + ... + c_d M^d takes levels spread evenly
+ *  over M in [0, 1] to exposure, and is normalized so p(1) = 1.  A sample's exposure is
+ *  proportional to exposure time, so each pair of exposures a, b adjacent in time gives
+ *  p(M_a) - (t_a / t_b) p(M_b) = 0, weighted by the product of the pixel values' weights.
+ *  Mitsunaga and Nayar also estimate the exposure ratios; ours are known, so the equations
+ *  are linear.  c_d is eliminated with the normalization, leaving d unknowns.
+ *
+ *  If prev is non NULL each equation is also divided by prev's value at M_a, so the
+ *  residuals are relative, like those of the log space solvers, rather than absolute.
+ */
+static void addPolynomialDataTerm(const CTFAccumulator& system, size_t degree,
+    PolyMatrix& N, PolyVector& r, const PolyVector* prev = NULL)
+{
+    const double MIN_SCALE = 1e-3; //Relative to p(1)
+
+    const size_t numSamples = system.getNumSamples();
+    const size_t numExposures = system.getNumExposures();
+    const double maxLevel = static_cast<double>(system.getNumLevels() - 1);
+
+    //Visit exposures in order of time
+    std::vector< std::pair<CTF::ctf_t, size_t> > byTime;
+    for(size_t j = 0; j < numExposures; j++){
+        byTime.push_back(std::make_pair(system.getLogTime(j), j));
+    }
+    std::sort(byTime.begin(), byTime.end());
+
+    std::vector<double> powA(degree + 1), powB(degree + 1);
+    PolyVector d(degree);
+    for(size_t i = 0; i < numSamples; i++){ //Loop over sample positions
+        const double mult = system.getSampleMultiplicity(i);
+        for(size_t k = 0; k + 1 < numExposures; k++){ //Loop over adjacent exposures
+            const size_t a = byTime[k].second;
+            const size_t b = byTime[k+1].second;
+            const CTF::pixel_t pixA = system.getPixelValue(i,a);
+            const CTF::pixel_t pixB = system.getPixelValue(i,b);
+            const double w = static_cast<double>(system.getWeight(pixA)) * system.getWeight(pixB);
+            if(w == 0.0){
+                continue;
+            }
+            const double ratio = exp(static_cast<double>(byTime[k].first) - byTime[k+1].first);
+
+            powA[0] = powB[0] = 1.0;
+            for(size_t e = 1; e <= degree; e++){
+                powA[e] = powA[e-1] * (pixA / maxLevel);
+                powB[e] = powB[e-1] * (pixB / maxLevel);
+            }
+            const double top = powA[degree] - ratio * powB[degree];
+            for(size_t e = 0; e < degree; e++){
+                d(e) = (powA[e] - ratio * powB[e]) - top;
+            }
+
+            double w2 = mult * w * w;
+            if(prev != NULL){
+                const double scale = std::max(evalPolynomial(*prev, pixA / maxLevel), MIN_SCALE);
+                w2 /= scale * scale;
+            }
+            N.noalias() += w2 * d * d.transpose();
+            r.noalias() -= (w2 * top) * d;
+        }
+    }
+}
+
+
+/**
+ *  Solve normal equations from addPolynomialDataTerm(...) for all d + 1 coefficients.
+ */
+static PolyVector solvePolynomialCoefficients(const PolyMatrix& N, const PolyVector& r){
+    const size_t degree = r.size();
+    PolyVector c(degree + 1);
+    c.head(degree) = N.ldlt().solve(r);
+    c(degree) = 1.0 - c.head(degree).sum();
+    return c;
+}
+
+
+/**
+ *  Fit a polynomial inverse response to a system.  The absolute residuals of the
+ *  Mitsunaga and Nayar equations let the fit stray far from the truth, relatively, near
+ *  black, so the fit is refined a few times with relative residuals.  N and r are set
+ *  to the normal equations of the last refinement.
+ */
+static void fitPolynomial(const CTFAccumulator& system, size_t degree, PolyMatrix& N,
+    PolyVector& r)
+{
+    const int NUM_REWEIGHTS = 2;
+
+    N = PolyMatrix::Zero(degree, degree);
+    r = PolyVector::Zero(degree);
+    addPolynomialDataTerm(system, degree, N, r);
+    for(int it = 0; it < NUM_REWEIGHTS; it++){
+        const PolyVector prev = solvePolynomialCoefficients(N, r);
+        N.setZero();
+        r.setZero();
+        addPolynomialDataTerm(system, degree, N, r, &prev);
+    }
+}
+
+
+/**
+ *  Solve normal equations from fitPolynomial(...) and evaluate the log inverse response at
+ *  each of n levels, shifted to be 0 at n/2.  Responses that dip to or below 0 near black
+ *  are held at a small positive floor.
+ */
+static DenseVector solvePolynomialSystem(const PolyMatrix& N, const PolyVector& r, int n){
+    const double MIN_RESPONSE = 1e-6; //Relative to p(1)
+
+    const PolyVector c = solvePolynomialCoefficients(N, r);
+    std::vector<double> logResponse(n);
+    for(int z = 0; z < n; z++){
+        const double M = static_cast<double>(z) / (n - 1);
+        logResponse[z] = log(std::max(evalPolynomial(c, M), MIN_RESPONSE));
+    }
+
+    DenseVector g(n);
+    for(int z = 0; z < n; z++){
+        g(z) = static_cast<CTF::ctf_t>(logResponse[z] - logResponse[n/2]);
+    }
+    return g;
+}
+
+
+/**
+ *  Get the condition number of normal equations from fitPolynomial(...).
+ */
+static double polynomialConditionNumber(const PolyMatrix& N){
+    const Eigen::SelfAdjointEigenSolver<PolyMatrix> eig(N);
+    const PolyVector& values = eig.eigenvalues();
+    return values(0) > 0.0 ? values(values.size() - 1) / values(0) :
+        std::numeric_limits<double>::infinity();
+}
+
+
+/**
+ *  Fit a polynomial inverse response to a system, see fitPolynomial(...).  The system has
+ *  a handful of unknowns however many samples and levels there are, so this is very fast,
+ *  and the smoothing value is not used.
+ *
+ *  @return the vector of unknowns; the first n are the log CTF and, if solveIrradiances is
+ *   true, the remainder are the log irradiances of each sample.
+ */
+static DenseVector solvePolynomial(const CTFAccumulator& system, int n,
+    bool solveIrradiances, const SolverSettings& settings)
+{
+    Stopwatch watch(Stopwatch::THREAD);
+    const size_t degree = settings.polynomialDegree;
+    PolyMatrix N;
+    PolyVector r;
+    fitPolynomial(system, degree, N, r);
+    recordAssembly(settings, watch, degree, degree, degree * degree);
+
+    const size_t numSamples = system.getNumSamples();
+    DenseVector x(solveIrradiances ? n + numSamples : n);
+    x.head(n) = solvePolynomialSystem(N, r, n);
+    recordFactorization(settings, watch);
+
+    //Back substitute for the sample unknowns
+    if(solveIrradiances){
+        const DenseVector g = x.head(n);
+        for(size_t i = 0; i < numSamples; i++){
+            x(n+i) = sampleLogIrradiance(system, i, g);
+        }
+    }
+
+    return x;
+}
+
+
+/**
+ *  Solve an accumulated system with the given solver.  info, if not NULL, is set to how
+ *  the ITERATIVE solver converged; other solvers leave it alone.  Without an initial CTF,
+ *  the ITERATIVE solver starts long curves from solveCoarse(...), since the smoothness
+ *  term only carries information between neighbouring unknowns and a cold start on a
+ *  curve with thousands of them converges very slowly.
+ *
+ *  @return the vector of unknowns; the first n are the log CTF and, if solveIrradiances is
+ *   true, the remainder are the log irradiances of each sample.
+ */
+static DenseVector solveSystem(const CTFAccumulator& system, CTFSolver::SolverType solverType,
+    CTF::ctf_t lambda, int n, bool solveIrradiances, const SolverSettings& settings,
+    CTFSolver::ConvergenceInfo* info)
+{
+    switch(solverType){
+        case CTFSolver::SVD:
+            return solveSVD(system, lambda, n, settings);
+        case CTFSolver::SPARSE_CHOLESKY:
+            return solveSparseCholesky(system, lambda, n, settings);
+        case CTFSolver::SCHUR:
+            return solveSchur(system, lambda, n, solveIrradiances, settings);
+        case CTFSolver::ITERATIVE:
+            if(settings.initialCTF == NULL && n > COARSE_LEVELS){
+                const CTF coarse = solveCoarse(system, lambda, n, settings);
+                SolverSettings warmSettings(settings);
+                warmSettings.initialCTF = &coarse;
+                return solveIterative(system, lambda, n, solveIrradiances, warmSettings, info);
+            }
+            return solveIterative(system, lambda, n, solveIrradiances, settings, info);
+        case CTFSolver::POLYNOMIAL:
+            return solvePolynomial(system, n, solveIrradiances, settings);
+        default:
+            //This case should never occur, since the switch statement
+            //should be exhaustive for all possible solvers
+            assert(false);
+            return solveSVD(system, lambda, n, settings);
+    }
+}
+
+
+/**
+ *  Solve the reduced system (D + lambda^2 R) x = s for the log CTF for several values of
+ *  lambda, with the CTF fixed to 0 at fixedIndex.  D is the data term and R the smoothness
+ *  term for lambda = 1.
+ *
+ *  With the fixed unknown removed, D + R is positive definite, so D + R and R can be
+ *  diagonalized together: V^T (D + R) V = I and V^T R V = diag(mu) with 0 <= mu <= 1.
+ *  Then D + lambda^2 R = V^-T (I + (lambda^2 - 1) diag(mu)) V^-1, and each lambda only
+ *  costs two matrix-vector products.  The terms are assembled and decomposed in double
+ *  precision since all the solves share them.
+ */
+static void sweepCurveSystem(const DoubleMatrix& D, const DoubleVector& s, const DoubleMatrix& R,
+    const std::vector<CTF::ctf_t>& lambdas, int fixedIndex, std::vector<DenseVector>& outCurves)
+{
+
+    //Remove the fixed unknown
+    const int n = D.rows();
+    const int m = n - 1;
+    DoubleMatrix A(m,m), B(m,m);
+    DoubleVector b(m);
+    for(int p = 0; p < m; p++){
+        const int pp = p < fixedIndex ? p : p + 1;
+        for(int q = 0; q < m; q++){
+            const int qq = q < fixedIndex ? q : q + 1;
+            A(p,q) = R(pp,qq);
+            B(p,q) = D(pp,qq) + R(pp,qq);
+        }
+        b(p) = s(pp);
+    }
+
+    const Eigen::GeneralizedSelfAdjointEigenSolver<DoubleMatrix> eig(A, B);
+    const DoubleMatrix& V = eig.eigenvectors();
+    const DoubleVector& mu = eig.eigenvalues();
+    const DoubleVector y = V.transpose() * b;
+
+    outCurves.resize(lambdas.size());
+    for(size_t l = 0; l < lambdas.size(); l++){
+        const double lambda2 = static_cast<double>(lambdas[l]) * lambdas[l];
+        DoubleVector z(m);
+        for(int k = 0; k < m; k++){
+            //Directions constrained by neither term(lambda = 0 and no data) are left at 0
+            const double scale = 1.0 + (lambda2 - 1.0) * mu(k);
+            z(k) = scale > 1e-12 ? y(k) / scale : 0.0;
+        }
+        const DoubleVector xr = V * z;
+
+        DenseVector& x = outCurves[l];
+        x.resize(n);
+        for(int p = 0; p < m; p++){
+            x(p < fixedIndex ? p : p + 1) = static_cast<CTF::ctf_t>(xr(p));
+        }
+        x(fixedIndex) = static_cast<CTF::ctf_t>(0.0);
+    }
+}
+
+
+/**
+ *  Add the fit error of some samples under the log CTF g, with each sample given the
+ *  irradiance that best fits it, to errorSum.  Samples first, first + stride, ... are used.
+ *  The error of a sample is its weighted sum of squared fitting equation residuals, and
+ *  the weights are summed into weightSum.
+ */
+static void addSampleFitError(const CTFAccumulator& system, size_t first, size_t stride,
+    const DenseVector& g, double& errorSum, double& weightSum)
+{
+    for(size_t i = first; i < system.getNumSamples(); i += stride){ //Loop over sample positions
+        const CTF::ctf_t logE = sampleLogIrradiance(system, i, g);
+        const CTF::ctf_t mult = system.getSampleMultiplicity(i);
+        for(size_t j = 0; j < system.getNumExposures(); j++){ //Loop over images
+            const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+            const double w2 = mult * system.getWeight(pixVal) * system.getWeight(pixVal);
+            const double r = g(pixVal) - logE - system.getLogTime(j);
+            errorSum  += w2 * r * r;
+            weightSum += w2;
+        }
+    }
+}
+
+
+/**
+ *  Get an accumulated system ready to solve.  Samples that are not monotonic in exposure
+ *  time are dropped first, when monotonicityTolerance is not negative, and then samples
+ *  with the same pixel values in every image, which give identical equations, are merged
+ *  into one weighted sample.
+ *
+ *  @return the index of the sample in the prepared system that each original sample
+ *   became, or CTFAccumulator::REJECTED.
+ */
+static std::vector<size_t> prepareSystem(CTFAccumulator& system, int monotonicityTolerance){
+    std::vector<size_t> sampleMap;
+    if(monotonicityTolerance >= 0){
+        sampleMap = system.rejectNonMonotonicSamples(monotonicityTolerance);
+    }
+
+    const std::vector<size_t> mergeMap = system.mergeDuplicateSamples();
+    if(sampleMap.empty()){
+        return mergeMap;
+    }
+    for(size_t i = 0; i < sampleMap.size(); i++){
+        if(sampleMap[i] != CTFAccumulator::REJECTED){
+            sampleMap[i] = mergeMap[sampleMap[i]];
+        }
+    }
+    return sampleMap;
+}
+
+
+/**
+ *  Get the weighted RMS residual of the fitting equations of sample i under the log CTF g,
+ *  with the sample given the irradiance that best fits it.
+ */
+static CTF::ctf_t sampleFitResidual(const CTFAccumulator& system, size_t i, const DenseVector& g){
+    const CTF::ctf_t logE = sampleLogIrradiance(system, i, g);
+    CTF::ctf_t errorSum  = static_cast<CTF::ctf_t>(0.0);
+    CTF::ctf_t weightSum = static_cast<CTF::ctf_t>(0.0);
+    for(size_t j = 0; j < system.getNumExposures(); j++){ //Loop over images
+        const CTF::pixel_t pixVal = system.getPixelValue(i,j);
+        const CTF::ctf_t w2 = system.getWeight(pixVal) * system.getWeight(pixVal);
+        const CTF::ctf_t r  = g(pixVal) - logE - system.getLogTime(j);
+        errorSum  += w2 * r * r;
+        weightSum += w2;
+    }
+    return weightSum > static_cast<CTF::ctf_t>(0.0) ? sqrt(errorSum / weightSum) :
+        static_cast<CTF::ctf_t>(0.0);
+}
+
+
+/**
+ *  Solve an accumulated system as solveSystem(...) does, then refit it robustIterations
+ *  times with iteratively reweighted least squares.
+ *
+ *  Each refit weights every sample by the Cauchy weight of its RMS fitting residual under
+ *  the previous curve, 1 / (1 + (r / c)^2), where c is 2.385 times a robust estimate of the
+ *  residual scale(1.4826 times the median residual).  Samples that disagree with the curve
+ *  fitted to the bulk of the data, such as those on moving objects, fade out instead of
+ *  being cut off at a hard threshold.  Refits are warm started from the previous curve.
+ *  The iterations of every refit are added to info.
+ */
+static DenseVector solveRobust(const CTFAccumulator& system, CTFSolver::SolverType solverType,
+    CTF::ctf_t lambda, int n, bool solveIrradiances, const SolverSettings& settings,
+    size_t robustIterations, CTFSolver::ConvergenceInfo* info)
+{
+    DenseVector x = solveSystem(system, solverType, lambda, n, solveIrradiances,
+        settings, info);
+
+    const size_t numSamps = system.getNumSamples();
+    std::vector<CTF::ctf_t> residuals(numSamps), factors(numSamps);
+    SolverSettings refitSettings(settings);
+    CTF prevCurve;
+    for(size_t it = 0; it < robustIterations && numSamps > 0; it++){
+        const DenseVector g = x.head(n);
+        for(size_t i = 0; i < numSamps; i++){
+            residuals[i] = sampleFitResidual(system, i, g);
+        }
+
+        //Robust scale of the residuals
+        std::vector<CTF::ctf_t> sorted(residuals);
+        std::nth_element(sorted.begin(), sorted.begin() + numSamps/2, sorted.end());
+        const CTF::ctf_t scale = static_cast<CTF::ctf_t>(1.4826) * sorted[numSamps/2];
+        if(scale <= static_cast<CTF::ctf_t>(0.0)){
+            break; //The bulk of the samples fit exactly, so there is nothing to reweight
+        }
+
+        const CTF::ctf_t c = static_cast<CTF::ctf_t>(2.385) * scale;
+        for(size_t i = 0; i < numSamps; i++){
+            const CTF::ctf_t u = residuals[i] / c;
+            factors[i] = static_cast<CTF::ctf_t>(1.0) / (static_cast<CTF::ctf_t>(1.0) + u*u);
+        }
+        CTFAccumulator weighted(system);
+        weighted.scaleSamples(factors);
+
+        prevCurve = curveFromSolution(x, n, n);
+        refitSettings.initialCTF = &prevCurve;
+        CTFSolver::ConvergenceInfo refitInfo;
+        x = solveSystem(weighted, solverType, lambda, n, solveIrradiances, refitSettings,
+            info == NULL ? NULL : &refitInfo);
+        if(info != NULL && solverType == CTFSolver::ITERATIVE){
+            refitInfo.iterations += info->iterations;
+            *info = refitInfo;
+        }
+    }
+
+    return x;
+}
+
+
+void CTFSolver::makeWeightLUT(CTF::ctf_t* wLut, size_t numLevels)const{
+    //We don't care that we branch inside of the loop since this LUT is created once
+    //Levels are spread over the 8 bit range the weighting functions are defined on
+    for(size_t i = 0; i < numLevels; i++){
+        CTF::ctf_t val = static_cast<CTF::ctf_t>(1.0);
+        const CTF::ctf_t z = static_cast<CTF::ctf_t>(i * 255.0 / (numLevels - 1));
+        switch(wFunc){
+            case HAT:
+                val = hatFunc(z);
+                break;
+            case HAT_10:
+                val = hatFuncParameterized(z, static_cast<CTF::ctf_t>(10.0));
+                break;
+            default:
+                //This case should never occur, since the switch statement
+                //should be exhaustive for all possible weighting functions
+                assert(false);
+                val = hatFunc(z);
+                break;
+        }
+        wLut[i] = val;
+    }
+}
+
+
+int CTFSolver::getBinShift()const{
+    int shift = 0;
+    while((getNumLevels() << shift) < (size_t(1) << bitDepth)){
+        ++shift;
+    }
+    return shift;
+}
+
+
+//Convert pixel values read from images into levels, in place
+void CTFSolver::quantizeSamples(std::vector< std::vector<unsigned short> >& values)const{
+    const int binShift = getBinShift();
+    for(size_t c = 0; c < values.size(); c++){
+        for(size_t i = 0; i < values[c].size(); i++){
+            values[c][i] = pixelLevel(values[c][i], bitDepth, binShift);
+        }
+    }
+}
+
+
+/**
+ *  Add the joint histogram of the pixel values of two exposures to hist, where
+ *  hist[a*256 + b] counts the pixels with value a in the first and b in the second.
+ *  Each thread fills its own histogram, and these are summed at the end.
+ */
+static void addJointHistogram(const unsigned char* first, const unsigned char* second,
+    long numPixels, unsigned int* hist)
+{
+    #pragma omp parallel
+    {
+        std::vector<unsigned int> local(256 * 256, 0);
+
+        #pragma omp for schedule(static)
+        for(long p = 0; p < numPixels; p++){
+            ++local[first[p] * 256 + second[p]];
+        }
+
+        #pragma omp critical
+        for(int k = 0; k < 256 * 256; k++){
+            hist[k] += local[k];
+        }
+    }
+}
+
+
+/**
+ *  Add the normal equations of the comparametric fitting term to the reduced n x n system
+ *  for the CTF unknowns.
+ *
+ *  A pixel with value a in one exposure and b in the next, longer, exposure gives the
+ *  equation g(b) - g(a) = ln(t_next) - ln(t).  Every pixel in a bin of the joint histogram
+ *  gives the same equation, so each bin contributes it once, weighted by its count and the
+ *  smaller weight of the two pixel values.
+ *
+ *  @param hist is the joint histogram of the two exposures.
+ *  @param logTimeDiff is ln(t_next) - ln(t).
+ *  @param scale multiplies the counts in the histogram.
+ */
+template<typename Scalar>
+static void addComparametricTerm(Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& S,
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s, const unsigned int* hist,
+    const CTF::ctf_t* wLut, CTF::ctf_t logTimeDiff, CTF::ctf_t scale, int n)
+{
+    for(int a = 0; a < n; a++){
+        for(int b = 0; b < n; b++){
+            const unsigned int count = hist[a*n + b];
+            const CTF::ctf_t w = std::min(wLut[a], wLut[b]);
+            if(count == 0 || w == static_cast<CTF::ctf_t>(0.0) || a == b){
+                continue;
+            }
+
+            const Scalar w2 = static_cast<Scalar>(scale) * count * w * w;
+            S(a,a) += w2;
+            S(b,b) += w2;
+            S(a,b) -= w2;
+            S(b,a) -= w2;
+            s(a)   -= w2 * logTimeDiff;
+            s(b)   += w2 * logTimeDiff;
+        }
+    }
+}
+
+
+/**
+ *  Add the comparametric fitting terms of each pair of adjacent exposures in a stack to the
+ *  reduced system of each channel.  scaleSamples is the number of samples the fitting terms
+ *  of the stack count as.  Images are box filtered down to blockSize x blockSize blocks
+ *  first when blockSize > 1.
+ */
+template<typename Scalar>
+static void addComparametricStack(const std::vector<CTFSolver::ImageExposurePair>& images,
+    const std::vector<size_t>& channels, const CTF::ctf_t* wLut, size_t scaleSamples,
+    int blockSize, std::vector< Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> >& systems,
+    std::vector< Eigen::Matrix<Scalar, Eigen::Dynamic, 1> >& rhs)
+{
+    //n = 256 for 8 bit images
+    const int n = 256;
+
+    //Pair up the exposures in order of exposure time
+    std::vector<CTFSolver::ImageExposurePair> sorted(images);
+    std::sort(sorted.begin(), sorted.end());
+
+    //Load the first image
+    CImg<unsigned char> prevIm(sorted[0].imagePath.c_str());
+    CImg<unsigned char> currIm;
+    if(blockSize > 1){
+        prevIm = boxDownsample(prevIm, blockSize);
+    }
+    const long numPixels = static_cast<long>(prevIm.width()) * prevIm.height();
+
+    //Weight the histogram counts so that the fitting term counts as much as numSamples
+    //samples would in the other solvers, keeping lambda comparable between them
+    const CTF::ctf_t scale = static_cast<CTF::ctf_t>(scaleSamples) / numPixels;
+
+    //Fit each pair of adjacent exposures
+    std::vector<unsigned int> hist(n * n);
+    for(size_t j = 1; j < sorted.size(); j++){
+        currIm.load(sorted[j].imagePath.c_str());
+        if(blockSize > 1){
+            currIm = boxDownsample(currIm, blockSize);
+        }
+
+        //The histograms read both images pixel for pixel, so they must match
+        if(currIm.width() != prevIm.width() || currIm.height() != prevIm.height()){
+            throw CImgIOException("Image %s has different dimensions than %s",
+                sorted[j].imagePath.c_str(), sorted[j-1].imagePath.c_str());
+        }
+        for(size_t c = 0; c < channels.size(); c++){
+            if((size_t)currIm.spectrum() <= channels[c] || (size_t)prevIm.spectrum() <= channels[c]){
+                throw CImgIOException("Image %s or %s has no channel %d",
+                    sorted[j].imagePath.c_str(), sorted[j-1].imagePath.c_str(),
+                    static_cast<int>(channels[c]));
+            }
+        }
+
+        const CTF::ctf_t logTimeDiff =
+            log(sorted[j].getTime()) - log(sorted[j-1].getTime());
+
+        for(size_t c = 0; c < channels.size(); c++){
+            std::fill(hist.begin(), hist.end(), 0);
+            addJointHistogram(prevIm.data(0,0,0,channels[c]), currIm.data(0,0,0,channels[c]),
+                numPixels, &(hist[0]));
+            addComparametricTerm(systems[c], rhs[c], &(hist[0]), wLut, logTimeDiff, scale, n);
+        }
+
+        prevIm.swap(currIm);
+    }
+}
+
+
+template<typename Scalar>
+std::vector<CTF> CTFSolver::solveComparametric(const std::vector<size_t>& channels,
+    const CTF::ctf_t* wLut, SolveStats* retStats)const
+{
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+    //n = 256 for 8 bit images, the only ones handled; checked by solveChannels(...)
+    const int n = 256;
+    assert(bitDepth == 8 && getNumLevels() == (size_t)n);
+
+    //Reduced system for the CTF unknowns of each channel
+    std::vector<Matrix> systems(channels.size(), Matrix::Zero(n,n));
+    std::vector<Vector> rhs(channels.size(), Vector::Zero(n));
+
+    //Every stack adds its own fitting terms
+    Stopwatch watch;
+    const int blockSize = 1 << pyramidLevel;
+    addComparametricStack(imdata, channels, wLut, numSamples, blockSize, systems, rhs);
+    for(size_t k = 0; k < extraStacks.size(); k++){
+        addComparametricStack(extraStacks[k], channels, wLut, numSamples, blockSize,
+            systems, rhs);
+    }
+    if(retStats != NULL){
+        addStageTime(retStats->decode, watch);
+    }
+
+    //Solve each channel's system
+    std::vector<CTF> ctfs(channels.size());
+    for(size_t c = 0; c < channels.size(); c++){
+        addSmoothnessTerm(systems[c], wLut, lambda, n);
+        if(retStats != NULL){
+            recordCurveSystemStats(systems[c], retStats->channels[c], retStats->diagnostics);
+        }
+        watch.restart();
+        const DenseVector x = solveCurveSystem(systems[c], rhs[c], n/2, precision);
+        if(retStats != NULL){
+            addStageTime(retStats->channels[c].factorization, watch);
+            addStageTime(retStats->factorization, watch);
+        }
+
+        //Transfer the results into a CTF
+        ctfs[c] = curveFromSolution(x, n, n);
+    }
+
+    return ctfs;
+}
+
+
+/**
+ *  Solve jointly over this solver's stack and the extra stacks.  The stacks only share the
+ *  CTF unknowns, so eliminating each stack's irradiance unknowns leaves a reduced n x n
+ *  system that is just the sum of the reduced systems of the stacks.  Stacks are sampled
+ *  and reduced in parallel, and each stack's reduced system is added to a running sum as
+ *  soon as it is done, so time is linear in the number of stacks and memory is one n x n
+ *  system per channel and per thread.  The POLYNOMIAL solver sums its normal
+ *  equations over the stacks instead, each refined against its own stack's fit.
+ */
+template<typename Scalar>
+std::vector<CTF> CTFSolver::solveJoint(const std::vector<size_t>& channels,
+    const CTF::ctf_t* wLut, SolveStats* retStats)const
+{
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+    //One unknown per level; 256 for 8 bit images
+    const int n = getNumLevels();
+    assert(solverType == POLYNOMIAL || getNumLevels() <= MAX_DENSE_LEVELS);
+
+    std::vector<const std::vector<ImageExposurePair>*> stacks(1, &imdata);
+    for(size_t k = 0; k < extraStacks.size(); k++){
+        stacks.push_back(&(extraStacks[k]));
+    }
+
+    //Reduced system of each channel, summed over the stacks
+    //The polynomial solver's normal equations sum over stacks the same way
+    const bool polynomial = solverType == POLYNOMIAL;
+    const size_t degree = polynomialDegree;
+    std::vector<Matrix> jointSystems;
+    std::vector<Vector> jointRHS;
+    std::vector<PolyMatrix> jointPolySystems;
+    std::vector<PolyVector> jointPolyRHS;
+    if(polynomial){
+        jointPolySystems.assign(channels.size(), PolyMatrix::Zero(degree, degree));
+        jointPolyRHS.assign(channels.size(), PolyVector::Zero(degree));
+    }else{
+        jointSystems.assign(channels.size(), Matrix::Zero(n,n));
+        jointRHS.assign(channels.size(), Vector::Zero(n));
+    }
+    std::vector< std::vector<StageTime> > stackDecodeTimes(stacks.size());
+    Stopwatch watch;
+
+    //Exceptions cannot leave a parallel region, so the first error is thrown again once every
+    //stack is done
+    //Stacks are added to the sums in order, so the result does not depend on scheduling.  A
+    //thread waits for the stacks before its own, so each thread holds at most one stack's
+    //reduced system.
+    std::vector<std::string> stackErrors(stacks.size());
+    #pragma omp parallel for ordered schedule(dynamic)
+    for(int k = 0; k < (int)stacks.size(); k++){
+        std::vector<Matrix> stackSystems;
+        std::vector<Vector> stackRHS;
+        std::vector<PolyMatrix> stackPolySystems;
+        std::vector<PolyVector> stackPolyRHS;
+        try{
+            std::vector<SamplePos> samplePositions;
+            std::vector<size_t> order;
+            std::vector<CTFAccumulator> systems;
+            accumulateSamples(*(stacks[k]), channels, wLut, samplePositions, order, systems,
+                NULL, NULL, &(stackDecodeTimes[k]));
+
+            if(polynomial){
+                stackPolySystems.resize(channels.size());
+                stackPolyRHS.resize(channels.size());
+            }else{
+                stackSystems.assign(channels.size(), Matrix::Zero(n,n));
+                stackRHS.assign(channels.size(), Vector::Zero(n));
+            }
+            for(size_t c = 0; c < channels.size(); c++){
+                prepareSystem(systems[c], monotonicityTolerance);
+                if(polynomial){
+                    fitPolynomial(systems[c], degree, stackPolySystems[c], stackPolyRHS[c]);
+                }else{
+                    addReducedDataTerm(systems[c], 0, 1, stackSystems[c], stackRHS[c]);
+                }
+            }
+        }catch(const std::exception& ex){
+            stackErrors[k] = ex.what();
+        }
+
+        #pragma omp ordered
+        {
+            if(stackErrors[k].empty()){
+                for(size_t c = 0; c < channels.size(); c++){
+                    if(polynomial){
+                        jointPolySystems[c] += stackPolySystems[c];
+                        jointPolyRHS[c] += stackPolyRHS[c];
+                    }else{
+                        jointSystems[c] += stackSystems[c];
+                        jointRHS[c] += stackRHS[c];
+                    }
+                }
+            }
+        }
+    }
+    for(size_t k = 0; k < stacks.size(); k++){
+        if(!stackErrors[k].empty()){
+            throw CImgIOException("%s", stackErrors[k].c_str());
+        }
+    }
+
+    if(retStats != NULL){
+        addStageTime(retStats->decode, watch);
+        for(size_t k = 0; k < stacks.size(); k++){
+            retStats->imageDecode.insert(retStats->imageDecode.end(),
+                stackDecodeTimes[k].begin(), stackDecodeTimes[k].end());
+        }
+    }
+
+    //Solve each channel's summed system
+    std::vector<CTF> ctfs(channels.size());
+    for(size_t c = 0; c < channels.size(); c++){
+        watch.restart();
+        if(polynomial){
+            const PolyMatrix& N = jointPolySystems[c];
+            const PolyVector& r = jointPolyRHS[c];
+            ctfs[c] = curveFromSolution(solvePolynomialSystem(N, r, n), n,
+                size_t(1) << bitDepth);
+            if(retStats != NULL){
+                SystemStats& stats = retStats->channels[c];
+                stats.rows     = degree;
+                stats.cols     = degree;
+                stats.nonzeros = degree * degree;
+                stats.conditionNumber    = polynomialConditionNumber(N);
+                stats.fitResidual        = -1.0;
+                stats.smoothnessResidual = -1.0;
+            }
+        }else{
+            Matrix& S = jointSystems[c];
+            Vector& s = jointRHS[c];
+            addSmoothnessTerm(S, wLut, levelLambda(lambda, n), n);
+            if(retStats != NULL){
+                recordCurveSystemStats(S, retStats->channels[c], retStats->diagnostics);
+                watch.restart();
+            }
+            ctfs[c] = curveFromSolution(solveCurveSystem(S, s, n/2, precision), n,
+                size_t(1) << bitDepth);
+        }
+        if(retStats != NULL){
+            addStageTime(retStats->channels[c].factorization, watch);
+            addStageTime(retStats->factorization, watch);
+        }
+    }
+
+    return ctfs;
+}
+
+
+CTF CTFSolver::solve(std::vector<PixelResult>* retPixels)const{
+    const std::vector<size_t> channels(1, chan);
+
+    //Solve for our one channel
+    std::vector< std::vector<PixelResult> > channelPixels;
+    std::vector<CTF> ctfs = solveChannels(channels,
+        retPixels == NULL ? NULL : &channelPixels);
+
+    if(retPixels != NULL){
+        assert(retPixels->empty());
+        retPixels->swap(channelPixels[0]);
+    }
+
+    return ctfs[0];
+}
+
+
+/**
+ *  Pick the sample positions in a stack of images, then read every image and add it to the
+ *  system of each channel.  Samples are taken from level pyramidLevel of the image pyramid.
+ *
+ *  @param outPositions is set to the sample positions at that level, sorted by row.
+ *  @param outOrder is set to the order the images were added in; outOrder[j] is the index
+ *   in images of exposure j of each system.
+ *  @param outSystems is set to the system of each channel, in the same order as channels.
+ *  @param outWidth and outHeight, if not NULL, are set to the dimensions of the images at
+ *   that level.
+ */
+void CTFSolver::accumulateSamples(const std::vector<ImageExposurePair>& images,
+    const std::vector<size_t>& channels, const CTF::ctf_t* wLut,
+    std::vector<SamplePos>& outPositions, std::vector<size_t>& outOrder,
+    std::vector<CTFAccumulator>& outSystems, int* outWidth, int* outHeight,
+    std::vector<StageTime>* outDecodeTimes)const
+{
+    //Images are added to the system starting with the reference image, which is the
+    //middle exposure for stratified sampling.  The rest follow in their original order.
+    std::vector<size_t>& order = outOrder;
+    order.clear();
+    if(sampling == STRATIFIED){
+        std::vector< std::pair<long,size_t> > byTime;
+        for(size_t j = 0; j < images.size(); j++){
+            byTime.push_back(std::make_pair(images[j].microseconds, j));
+        }
+        std::sort(byTime.begin(), byTime.end());
+        order.push_back(byTime[byTime.size()/2].second);
+    }else{
+        order.push_back(0);
+    }
+    for(size_t j = 0; j < images.size(); j++){
+        if(j != order[0]){
+            order.push_back(j);
+        }
+    }
+
+    //Pick sample positions in the reference image, at the pyramid level we sample from
+    const int blockSize = 1 << pyramidLevel;
+    const bool wide = bitDepth > 8;
+    const int maxValue = (1 << bitDepth) - 1;
+    std::vector<SamplePos>& samplePositions = outPositions;
+    std::vector< std::vector< std::vector<unsigned short> > > vals(images.size());
+    std::vector<StageTime> decodeTimes(images.size());
+    //Seeded once here, so both pixel types draw the same positions for a given seed
+    RandomGenerator rng(seed);
+    int firstWidth, firstHeight;
+    const Stopwatch referenceWatch(Stopwatch::THREAD);
+    if(wide){
+        sampleReference<unsigned short>(images[order[0]].imagePath, blockSize, sampling,
+            maxValue, numSamples, rng, channels, samplePositions, vals[0],
+            firstWidth, firstHeight);
+    }else{
+        sampleReference<unsigned char>(images[order[0]].imagePath, blockSize, sampling,
+            maxValue, numSamples, rng, channels, samplePositions, vals[0],
+            firstWidth, firstHeight);
+    }
+    quantizeSamples(vals[0]);
+    decodeTimes[order[0]].wallSeconds = referenceWatch.wallSeconds();
+    decodeTimes[order[0]].cpuSeconds  = referenceWatch.cpuSeconds();
+    if(outWidth != NULL && outHeight != NULL){
+        *outWidth  = firstWidth;
+        *outHeight = firstHeight;
+    }
+
+    //Read the other images concurrently
+    //Only the pixel values at the sample positions are read; the reference image is already
+    //decoded, and the others are read sparsely when their format allows it.  Pixel values
+    //are converted to levels as they are read.  Images vary a lot in cost(a sparse read
+    //against a whole decode), so they are handed out one at a time.  Exceptions cannot
+    //leave a parallel region, so a loading error is thrown again once every thread is done.
+    const SampledImageReader reader(samplePositions, blockSize);
+    std::vector<std::string> loadErrors(images.size());
+    #pragma omp parallel for schedule(dynamic,1) num_threads(decodeThreadCount(numDecodeThreads))
+    for(int j = 1; j < (int)images.size(); j++){
+        const Stopwatch watch(Stopwatch::THREAD);
+        try{
+            readSamples(images[order[j]].imagePath, reader, samplePositions, channels,
+                firstWidth, firstHeight, wide, vals[j]);
+            quantizeSamples(vals[j]);
+        }catch(const std::exception& ex){
+            loadErrors[j] = ex.what();
+        }
+        decodeTimes[order[j]].wallSeconds = watch.wallSeconds();
+        decodeTimes[order[j]].cpuSeconds  = watch.cpuSeconds();
+    }
+    for(size_t j = 1; j < images.size(); j++){
+        if(!loadErrors[j].empty()){
+            throw CImgIOException("%s", loadErrors[j].c_str());
+        }
+    }
+    if(outDecodeTimes != NULL){
+        outDecodeTimes->insert(outDecodeTimes->end(), decodeTimes.begin(), decodeTimes.end());
+    }
+
+    //Add each image to the system of every channel, in order, so the sums do not depend on
+    //which thread read what
+    std::vector<CTFAccumulator>& systems = outSystems;
+    systems.assign(channels.size(), CTFAccumulator(numSamples, wLut, getNumLevels()));
+    for(size_t j = 0; j < images.size(); j++){ //Loop over images
+        const CTF::ctf_t t = images[order[j]].getTime();
+        assert(t > 0.0);
+
+        for(size_t c = 0; c < channels.size(); c++){ //Loop over channels
+            systems[c].addExposure(&(vals[j][c][0]), log(t));
+        }
+    }
+}
+
+
+//Most CTF unknowns the SVD solver is used for.  It factors the whole system, with a column
+//for every sample as well as every unknown, so longer curves use SCHUR, which solves the
+//same least squares problem.
+static const size_t MAX_SVD_LEVELS = 256;
+
+
+/**
+ *  Get the solver that is run for a curve with n CTF unknowns when type is asked for.
+ *  Curves too long for the dense solvers are solved iteratively, and the polynomial solver
+ *  has no dense system.
+ */
+static CTFSolver::SolverType solverForLevels(CTFSolver::SolverType type, size_t n){
+    if(type == CTFSolver::POLYNOMIAL){
+        return type;
+    }
+    if(n > CTFSolver::MAX_DENSE_LEVELS){
+        return CTFSolver::ITERATIVE;
+    }
+    if(type == CTFSolver::SVD && n > MAX_SVD_LEVELS){
+        return CTFSolver::SCHUR;
+    }
+    return type;
+}
+
+
+std::vector<CTF> CTFSolver::solveChannels(const std::vector<size_t>& channels,
+    std::vector< std::vector<PixelResult> >* retPixels,
+    std::vector<ConvergenceInfo>* retConvergence, SolveStats* retStats)const
+{
+    assert(!channels.empty());
+    assert(imdata.size() >= 2);
+
+    //One unknown per level; 256 for 8 bit images
+    const int n = getNumLevels();
+    const size_t numLevels = size_t(1) << bitDepth;
+
+    //Make a lookup table for our weighting function
+    std::vector<CTF::ctf_t> wLut(n);
+    makeWeightLUT(&(wLut[0]), n);
+
+    //Convergence is only reported by the iterative solver
+    if(retConvergence != NULL){
+        ConvergenceInfo direct;
+        direct.iterations = 0;
+        direct.residual   = static_cast<CTF::ctf_t>(0.0);
+        direct.converged  = true;
+        retConvergence->assign(channels.size(), direct);
+    }
+
+    if(retStats != NULL){
+        *retStats = SolveStats();
+        retStats->channels.assign(channels.size(), SystemStats());
+    }
+
+    //The comparametric solver uses every pixel rather than random samples
+    //Its joint histograms have one bin per pair of 8 bit pixel values
+    if(solverType == COMPARAMETRIC){
+        if(bitDepth != 8 || numLevels != (size_t)n){
+            throw CImgIOException("The comparametric solver only handles 8 bit images without bins");
+        }
+        if(retPixels != NULL){
+            assert(retPixels->empty());
+            retPixels->resize(channels.size());
+        }
+        if(isDoubleSystem(precision, n)){
+            return solveComparametric<double>(channels, &(wLut[0]), retStats);
+        }
+        return solveComparametric<CTF::ctf_t>(channels, &(wLut[0]), retStats);
+    }
+
+    //Several stacks are solved jointly, without sample irradiances
+    if(!extraStacks.empty()){
+        if(retPixels != NULL){
+            assert(retPixels->empty());
+            retPixels->resize(channels.size());
+        }
+        if(isDoubleSystem(precision, n)){
+            return solveJoint<double>(channels, &(wLut[0]), retStats);
+        }
+        return solveJoint<CTF::ctf_t>(channels, &(wLut[0]), retStats);
+    }
+
+    Stopwatch watch;
+    std::vector<SamplePos> samplePositions;
+    std::vector<size_t> order;
+    std::vector<CTFAccumulator> systems;
+    accumulateSamples(imdata, channels, &(wLut[0]), samplePositions, order, systems,
+        NULL, NULL, retStats != NULL ? &(retStats->imageDecode) : NULL);
+    if(retStats != NULL){
+        addStageTime(retStats->decode, watch);
+    }
+
+    //Solve each channel's system concurrently
+    SolverSettings settings;
+    settings.tolerance        = tolerance;
+    settings.maxIterations    = maxIterations;
+    settings.initialCTF       = useInitialCTF ? &initialCTF : NULL;
+    settings.polynomialDegree = polynomialDegree;
+    settings.precision        = precision;
+    settings.stats            = NULL;
+    const SolverType type = solverForLevels(solverType, n);
+    const bool extractPoints = retPixels != NULL;
+    std::vector<CTF> ctfs(channels.size());
+    std::vector<DenseVector> curves(retStats != NULL ? channels.size() : 0);
+    if(extractPoints){
+        assert(retPixels->empty());
+        retPixels->resize(channels.size());
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for(int c = 0; c < (int)channels.size(); c++){
+        //Drop outliers and merge duplicate samples
+        const std::vector<size_t> sampleMap = prepareSystem(systems[c], monotonicityTolerance);
+
+        SolverSettings channelSettings(settings);
+        if(retStats != NULL){
+            channelSettings.stats = &(retStats->channels[c]);
+        }
+        const DenseVector x = solveRobust(systems[c], type, levelLambda(lambda, n), n,
+            extractPoints, channelSettings, robustIterations,
+            retConvergence == NULL ? NULL : &((*retConvergence)[c]));
+
+        //Transfer the results into a CTF
+        ctfs[c] = curveFromSolution(x, n, numLevels);
+        if(retStats != NULL){
+            curves[c] = x.head(n);
+        }
+
+        //Potentially extract the pixel values to verify quality of fit
+        if(extractPoints){
+            std::vector<PixelResult>& pixels = (*retPixels)[c];
+            for(size_t i = 0; i < numSamples; i++){
+               if(sampleMap[i] == CTFAccumulator::REJECTED){
+                   continue;
+               }
+               PixelResult curr;
+               curr.x = samplePositions[i].x << pyramidLevel;
+               curr.y = samplePositions[i].y << pyramidLevel;
+               curr.irradiance = exp(x(n + sampleMap[i]));
+               curr.pixelValues.resize(imdata.size());
+               for(size_t j = 0; j < imdata.size(); j++){
+                   curr.pixelValues[order[j]] = systems[c].getPixelValue(sampleMap[i], j);
+               }
+               pixels.push_back(curr);
+            }
+        }
+    }
+
+    //Diagnose the fit of each channel
+    if(retStats != NULL){
+        watch.restart();
+        for(size_t c = 0; c < channels.size(); c++){
+            SystemStats& stats = retStats->channels[c];
+            computeFitStats(systems[c], curves[c], levelLambda(lambda, n), n, stats);
+            if(type == POLYNOMIAL){
+                PolyMatrix N;
+                PolyVector r;
+                fitPolynomial(systems[c], polynomialDegree, N, r);
+                stats.conditionNumber = polynomialConditionNumber(N);
+            }else if((size_t)n <= MAX_DENSE_LEVELS){
+                DoubleMatrix S = DoubleMatrix::Zero(n,n);
+                DoubleVector s = DoubleVector::Zero(n);
+                addReducedDataTerm(systems[c], 0, 1, S, s);
+                addSmoothnessTerm(S, &(wLut[0]), levelLambda(lambda, n), n);
+                stats.conditionNumber = estimateConditionNumber(S, n/2);
+            }
+            addStageTime(retStats->assembly, stats.assembly);
+            addStageTime(retStats->factorization, stats.factorization);
+        }
+        addStageTime(retStats->diagnostics, watch);
+    }
+
+    //All done
+    return ctfs;
+}
+
+
+std::vector< std::vector<CTFSolver::LambdaResult> > CTFSolver::sweepLambdas(
+    const std::vector<size_t>& channels, const std::vector<CTF::ctf_t>& lambdas,
+    size_t numFolds)const
+{
+    assert(!channels.empty());
+    assert(imdata.size() >= 2);
+    assert(!lambdas.empty());
+    assert(numFolds >= 2);
+    assert(getNumLevels() <= MAX_DENSE_LEVELS);
+
+    //One unknown per level; 256 for 8 bit images
+    const int n = getNumLevels();
+    const size_t numLevels = size_t(1) << bitDepth;
+
+    //Make a lookup table for our weighting function
+    std::vector<CTF::ctf_t> wLut(n);
+    makeWeightLUT(&(wLut[0]), n);
+
+    std::vector<SamplePos> samplePositions;
+    std::vector<size_t> order;
+    std::vector<CTFAccumulator> systems;
+    accumulateSamples(imdata, channels, &(wLut[0]), samplePositions, order, systems);
+
+    //The smoothness term does not depend on the data, so it is shared by every solve
+    DoubleMatrix R(n,n);
+    R.setZero();
+    addSmoothnessTerm(R, &(wLut[0]), static_cast<CTF::ctf_t>(1.0), n);
+
+    //Smoothing values scaled to the number of unknowns
+    std::vector<CTF::ctf_t> levelLambdas(lambdas.size());
+    for(size_t l = 0; l < lambdas.size(); l++){
+        levelLambdas[l] = levelLambda(lambdas[l], n);
+    }
+
+    std::vector< std::vector<LambdaResult> > results(channels.size());
+    #pragma omp parallel for schedule(dynamic)
+    for(int c = 0; c < (int)channels.size(); c++){
+        prepareSystem(systems[c], monotonicityTolerance);
+
+        //Data term of each fold; the data term of all samples is their sum
+        std::vector<DoubleMatrix> foldS(numFolds, DoubleMatrix::Zero(n,n));
+        std::vector<DoubleVector> foldRHS(numFolds, DoubleVector::Zero(n));
+        DoubleMatrix S = DoubleMatrix::Zero(n,n);
+        DoubleVector s = DoubleVector::Zero(n);
+        for(size_t k = 0; k < numFolds; k++){
+            addReducedDataTerm(systems[c], k, numFolds, foldS[k], foldRHS[k]);
+            S += foldS[k];
+            s += foldRHS[k];
+        }
+
+        //Curves fit to all samples
+        std::vector<DenseVector> curves;
+        sweepCurveSystem(S, s, R, levelLambdas, n/2, curves);
+
+        //Fit to all but one fold, and measure the error on that fold
+        std::vector<double> errorSums(lambdas.size(), 0.0);
+        std::vector<double> weightSums(lambdas.size(), 0.0);
+        for(size_t k = 0; k < numFolds; k++){
+            std::vector<DenseVector> foldCurves;
+            sweepCurveSystem(S - foldS[k], s - foldRHS[k], R, levelLambdas, n/2, foldCurves);
+            for(size_t l = 0; l < lambdas.size(); l++){
+                addSampleFitError(systems[c], k, numFolds, foldCurves[l],
+                    errorSums[l], weightSums[l]);
+            }
+        }
+
+        //Transfer the results
+        results[c].resize(lambdas.size());
+        for(size_t l = 0; l < lambdas.size(); l++){
+            results[c][l].lambda  = lambdas[l];
+            results[c][l].ctf     = curveFromSolution(curves[l], n, numLevels);
+            results[c][l].cvError = weightSums[l] > 0.0 ?
+                static_cast<CTF::ctf_t>(errorSums[l] / weightSums[l]) : static_cast<CTF::ctf_t>(0.0);
+        }
+    }
+
+    return results;
+}
+
+
+CTFSolver::IncrementalState::IncrementalState() :
+    width(-1), height(-1), blockSize(1)
+{}
+
+
+void CTFSolver::startIncremental(const std::vector<size_t>& channels,
+    IncrementalState& state)const
+{
+    assert(!channels.empty());
+
+    //Make a lookup table for our weighting function
+    std::vector<CTF::ctf_t> wLut(getNumLevels());
+    makeWeightLUT(&(wLut[0]), wLut.size());
+
+    std::vector<size_t> order;
+    state.channels = channels;
+    accumulateSamples(imdata, channels, &(wLut[0]), state.samplePositions, order,
+        state.systems, &state.width, &state.height);
+    state.blockSize = 1 << pyramidLevel;
+
+    state.exposures.clear();
+    for(size_t j = 0; j < order.size(); j++){
+        state.exposures.push_back(imdata[order[j]]);
+    }
+    state.curves.clear();
+}
+
+
+bool CTFSolver::addExposure(const ImageExposurePair& image, IncrementalState& state,
+    std::string* reason)const
+{
+    assert(!state.systems.empty());
+    assert(state.systems[0].getNumLevels() == getNumLevels());
+
+    const CTF::ctf_t t = image.getTime();
+    assert(t > 0.0);
+
+    //Reading the samples relies on the image matching the others, so check its header first
+    std::vector<ImageExposurePair> single(1, image);
+    int width, height, numChans;
+    if(!checkImagesOK(single, width, height, numChans, reason)){
+        return false;
+    }
+    if(width / state.blockSize != state.width || height / state.blockSize != state.height){
+        if(reason != NULL){
+            *reason = "Dimension Mismatch";
+        }
+        return false;
+    }
+    for(size_t c = 0; c < state.channels.size(); c++){
+        if(state.channels[c] >= (size_t)numChans){
+            if(reason != NULL){
+                *reason = "Channel out of range";
+            }
+            return false;
+        }
+    }
+
+    //Only read the pixel values at the sample positions
+    std::vector< std::vector<unsigned short> > vals;
+    const SampledImageReader reader(state.samplePositions, state.blockSize);
+    readSamples(image.imagePath, reader, state.samplePositions, state.channels,
+        state.width, state.height, bitDepth > 8, vals);
+    quantizeSamples(vals);
+
+    for(size_t c = 0; c < state.channels.size(); c++){ //Loop over channels
+        state.systems[c].addExposure(&(vals[c][0]), log(t));
+    }
+    state.exposures.push_back(image);
+    return true;
+}
+
+
+std::vector<CTF> CTFSolver::solveIncremental(IncrementalState& state,
+    std::vector<ConvergenceInfo>* retConvergence)const
+{
+    assert(state.getNumExposures() >= 2);
+    assert(state.systems[0].getNumLevels() == getNumLevels());
+
+    //One unknown per level; 256 for 8 bit images
+    const int n = getNumLevels();
+
+    const std::vector<size_t>& channels = state.channels;
+    const SolverType type = solverForLevels(solverType == COMPARAMETRIC ? SCHUR : solverType, n);
+    if(retConvergence != NULL){
+        ConvergenceInfo direct;
+        direct.iterations = 0;
+        direct.residual   = static_cast<CTF::ctf_t>(0.0);
+        direct.converged  = true;
+        retConvergence->assign(channels.size(), direct);
+    }
+
+    std::vector<CTF> ctfs(channels.size());
+    #pragma omp parallel for schedule(dynamic)
+    for(int c = 0; c < (int)channels.size(); c++){
+        //Merging is destructive, and later exposures need the unmerged system
+        CTFAccumulator system(state.systems[c]);
+        prepareSystem(system, monotonicityTolerance);
+
+        //Warm start from the last curve
+        SolverSettings settings;
+        settings.tolerance        = tolerance;
+        settings.maxIterations    = maxIterations;
+        settings.initialCTF       = !state.curves.empty() ? &(state.curves[c]) :
+            (useInitialCTF ? &initialCTF : NULL);
+        settings.polynomialDegree = polynomialDegree;
+        settings.precision        = precision;
+        settings.stats            = NULL;
+
+        const DenseVector x = solveRobust(system, type, levelLambda(lambda, n), n, false,
+            settings, robustIterations,
+            retConvergence == NULL ? NULL : &((*retConvergence)[c]));
+        ctfs[c] = curveFromSolution(x, n, size_t(1) << bitDepth);
+    }
+
+    state.curves = ctfs;
+    return ctfs;
 }
 
 
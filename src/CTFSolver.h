@@ -8,6 +8,8 @@
 //--
 #include "CTF.h"
 #include "WeightingFunctions.h"
+#include "CTFAccumulator.h"
+#include "SampledImageReader.h"
 
 //TODO: Account for blooming pixels
 class CTFSolver{
@@ -39,7 +41,8 @@ public:
      *  @param images is a list of ImageExposurePair structs.  Each image, as specified 
      *  by the imagePath member in struct ImageExposurePair, MUST exist on disk.  This is
      *  not checked by the code, and code will fail on solveCTF() if this is not the case.
-     *  Furthermore, all images must have the same dimensions.
+     *  Furthermore, all images must have the same dimensions.  At least 2 images are needed
+     *  to solve, though an incremental solve can start from 1(see startIncremental(...)).
      *  @param numSamps is the number of random image samples to take.  Defaults to 1000.
      *   Should always be greater than 256 in order to make the resulting linear system
      *   at least square.  Values > 256 result in an overdetermined system.
@@ -57,13 +60,172 @@ public:
     typedef struct PixelResult{
         CTF::ctf_t irradiance;
         int x,y;
+        std::vector<CTF::pixel_t> pixelValues; //Level in each image, in the order the images were given
     }PixelResult;
 
+    /**
+     *  Write the pixel value and exposure(time * irradiance) of each sample in each image.
+     *  Pixel values are taken from PixelResult::pixelValues when the solver filled them in;
+     *  only PixelResults without them require the images to be loaded again.
+     */
     bool writePixelPoints(const std::vector<PixelResult>& pixels,
         std::ostream& os)const;
 
     CTF solve(std::vector<PixelResult>* retPixels = NULL)const; 
 
+    //How an iterative solve ended
+    typedef struct ConvergenceInfo{
+        size_t iterations;   //Number of iterations taken
+        CTF::ctf_t residual; //Final norm of the normal equation residual, relative to A^T b
+        bool converged;      //Did the residual fall below the tolerance?
+    }ConvergenceInfo;
+
+    //Wall clock and CPU time spent in one stage of a solve
+    typedef struct StageTime{
+        double wallSeconds;
+        double cpuSeconds;
+    }StageTime;
+
+    //Size, timing and fit diagnostics of one channel's system
+    typedef struct SystemStats{
+        size_t rows, cols;          //Dimensions of the system matrix the solver built(or applies)
+        size_t nonzeros;            //Structural nonzeros of that matrix
+        StageTime assembly;         //Building the system, summed over robust refits
+        StageTime factorization;    //Factoring and solving it, or iterating on it
+        double conditionNumber;     //Estimate for the reduced curve system, or 0 if not estimated
+        double fitResidual;         //RMS weighted residual of the fitting equations, or -1
+        double smoothnessResidual;  //RMS residual of the smoothness equations, or -1
+        size_t levelsWithoutData;   //Weighted levels that no sample took
+        bool underdetermined;       //Too few samples to determine the curve without smoothing
+        bool smoothnessDominates;   //Smoothness term leaves more squared error than the fit
+    }SystemStats;
+
+    //Timing and diagnostics of a whole solve, see solveChannels(...)
+    typedef struct SolveStats{
+        StageTime decode;        //Reading and sampling the images
+        //Reading each image, in the order given followed by any extra stacks; images are
+        //read concurrently, so these can add up to more than decode.  Empty for COMPARAMETRIC.
+        std::vector<StageTime> imageDecode;
+        StageTime assembly;      //Summed over channels, which may be assembled concurrently
+        StageTime factorization; //Summed over channels, which may be solved concurrently
+        StageTime diagnostics;   //Filling in the rest of the stats
+        std::vector<SystemStats> channels; //In the same order as the channels solved for
+    }SolveStats;
+
+    /**
+     *  Solve for the CTF of several color channels at once.  Each image is only loaded
+     *  once, all channels are sampled at the same positions, and the per-channel systems
+     *  are solved concurrently.  The channel set with setChannelIndex(...) is ignored.
+     *  The COMPARAMETRIC solver does not use samples, so retPixels is left empty.  It throws
+     *  a CImgIOException unless the bit depth is 8 and there are no bins.
+     *
+     *  @param channels are the color channel indices to solve for.
+     *  @param retPixels, if not NULL, returns the sample irradiances and pixel values of each
+     *   channel in the same order as channels.  Samples dropped as outliers are left out.
+     *  @param retConvergence, if not NULL, returns how the ITERATIVE solver converged for
+     *   each channel in the same order as channels.  Direct solvers report 0 iterations.
+     *  @param retStats, if not NULL, returns timing and diagnostics of the solve.  The
+     *   condition number costs another factorization of the reduced curve system, and is
+     *   only estimated for curves of up to MAX_DENSE_LEVELS values.  The COMPARAMETRIC
+     *   solver and joint solves assemble while they read, so their assembly is counted
+     *   under decode, and they have no fitting or smoothness residuals.
+     *  @return the CTF of each channel, in the same order as channels.
+     */
+    std::vector<CTF> solveChannels(const std::vector<size_t>& channels,
+        std::vector< std::vector<PixelResult> >* retPixels = NULL,
+        std::vector<ConvergenceInfo>* retConvergence = NULL,
+        SolveStats* retStats = NULL)const;
+
+    //The curve for one smoothing value from a lambda sweep
+    typedef struct LambdaResult{
+        CTF::ctf_t lambda;
+        CTF ctf;            //Curve fit to all samples
+        CTF::ctf_t cvError; //Cross-validation error, see sweepLambdas(...)
+    }LambdaResult;
+
+    /**
+     *  Solve for the CTF of several color channels with each of several smoothing values.
+     *  The images are sampled and the data term is assembled once, then the reduced system
+     *  of the SCHUR solver is diagonalized together with the smoothness term, so each
+     *  smoothing value only costs a couple of matrix-vector products.  The solver type and
+     *  the smoothing value set with setSmoothingValue(...) are ignored.
+     *
+     *  Each channel also gets a k-fold cross-validation error per smoothing value.  Samples
+     *  are split into numFolds folds; the curve is fit to all but one fold, and each sample
+     *  of that fold gets the irradiance that best fits its own pixel values under that curve.
+     *  The cross-validation error is the weighted mean squared log residual of those
+     *  held-out samples, so smaller is better.
+     *
+     *  @param channels are the color channel indices to solve for.
+     *  @param lambdas are the smoothing values to solve with.
+     *  @param numFolds is the number of cross-validation folds.
+     *  @return a vector for each channel, in the same order as channels, holding a result
+     *   for each smoothing value, in the same order as lambdas.
+     */
+    std::vector< std::vector<LambdaResult> > sweepLambdas(const std::vector<size_t>& channels,
+        const std::vector<CTF::ctf_t>& lambdas, size_t numFolds = 5)const;
+
+    /**
+     *  The sampled systems of a stack that grows one exposure at a time.  It holds the sample
+     *  positions and the pixel values already read, so adding an exposure only reads that
+     *  image, and solving never reads any.  See startIncremental(...).
+     */
+    class IncrementalState{
+    public:
+        IncrementalState();
+
+        size_t getNumExposures()const;
+        const std::vector<ImageExposurePair>& getExposures()const;
+        const std::vector<size_t>& getChannels()const;
+
+    private:
+        friend class CTFSolver;
+
+        std::vector<size_t> channels;             //Channels being solved for
+        std::vector<SamplePos> samplePositions;   //Sample positions, sorted by row
+        int width, height;                        //Dimensions of every image, in blocks
+        int blockSize;                            //Pixels per block side at the sampled pyramid level
+        std::vector<ImageExposurePair> exposures; //Exposures in the order they were added
+        std::vector<CTFAccumulator> systems;      //Unmerged system of each channel
+        std::vector<CTF> curves;                  //Latest curve of each channel, if any
+    };
+
+    /**
+     *  Start an incremental solve.  Sample positions are picked as in solveChannels(...), and
+     *  every image given to the constructor is read into state.  A single image is enough
+     *  to start; at least 2 exposures are needed to solve.
+     *
+     *  @param channels are the color channel indices to solve for.
+     *  @param state is overwritten with the new state.
+     */
+    void startIncremental(const std::vector<size_t>& channels, IncrementalState& state)const;
+
+    /**
+     *  Add one exposure to an incremental solve.  Only the pixel values at the sample
+     *  positions are read.
+     *
+     *  @param reason is set to why the image was not added, if it is not NULL.
+     *  @return true if the image was added, false if it could not be loaded, its
+     *   dimensions differ from the other images, or it lacks a channel being solved for.
+     *   state is unchanged when false is returned.
+     */
+    bool addExposure(const ImageExposurePair& image, IncrementalState& state,
+        std::string* reason = NULL)const;
+
+    /**
+     *  Solve for the CTF of each channel from the exposures in state so far.  The solver
+     *  settings can change between calls.  The ITERATIVE solver starts from the curve of the
+     *  previous call, or the initial CTF on the first call, so refining the curve after each
+     *  new exposure only takes a few iterations.  The COMPARAMETRIC solver needs whole
+     *  images, so SCHUR is used in its place.
+     *
+     *  @param retConvergence is the same as for solveChannels(...).
+     *  @return the CTF of each channel, in the same order as the channels given to
+     *   startIncremental(...).
+     */
+    std::vector<CTF> solveIncremental(IncrementalState& state,
+        std::vector<ConvergenceInfo>* retConvergence = NULL)const;
+
     friend std::ostream& operator<<(std::ostream& os, const CTFSolver& solver);
 
     //Types of possible weighting functions
@@ -71,6 +233,147 @@ public:
     void setWeightingFunc(WeightingFunc func);
     WeightingFunc getWeightingFunc()const;
 
+    //Types of possible linear solvers
+    //SVD builds the dense system from the Debevec and Malik paper and solves it with a
+    //Jacobi SVD.  SPARSE_CHOLESKY builds the same system as a sparse matrix and solves
+    //the normal equations with a Cholesky factorization, which is far cheaper in time
+    //and memory for large sample counts.  SCHUR eliminates the per-sample irradiance
+    //unknowns while accumulating the system, so only a system with one unknown per pixel
+    //value(256 for 8 bit images) is ever built and solved regardless of the number of
+    //samples.  COMPARAMETRIC does not use random samples; it fits the curve to the joint
+    //histograms of the pixel values of each pair of adjacent exposures, so every pixel in
+    //the stack contributes.  ITERATIVE runs preconditioned conjugate gradients on the least
+    //squares system(CGLS), applying the system matrix directly from the sampled pixel
+    //values; it can be warm started from a known curve.  POLYNOMIAL fits a low degree
+    //polynomial inverse response to the ratios between adjacent exposures of each sample
+    //(Mitsunaga and Nayar 1999), which only takes a tiny system with one unknown per
+    //coefficient; it needs far fewer samples and ignores lambda, but cannot follow curves
+    //with sharp features.  Curves of more than 256 values use SCHUR in place of SVD.
+    enum SolverType{SVD, SPARSE_CHOLESKY, SCHUR, COMPARAMETRIC, ITERATIVE, POLYNOMIAL};
+    void setSolverType(SolverType type);
+    SolverType getSolverType()const;
+
+    //Settings for the ITERATIVE solver
+    //Iteration stops once the normal equation residual, relative to A^T b, falls below the
+    //tolerance, or after the maximum number of iterations
+    void setTolerance(CTF::ctf_t tol);
+    CTF::ctf_t getTolerance()const;
+    void setMaxIterations(size_t maxIters);
+    size_t getMaxIterations()const;
+
+    //Degree of the POLYNOMIAL solver's inverse response.  Defaults to 3, and may be at
+    //most MAX_POLYNOMIAL_DEGREE.
+    void setPolynomialDegree(size_t degree);
+    size_t getPolynomialDegree()const;
+    static const size_t MAX_POLYNOMIAL_DEGREE = 10;
+
+    //Floating point precision of the dense n x n system for the curve, used by the
+    //SPARSE_CHOLESKY, SCHUR and COMPARAMETRIC solvers and by joint solves.  SINGLE assembles,
+    //factors and solves the system in float, and DOUBLE in double.  MIXED assembles it in
+    //double, factors a float copy, and refines the solution against the double system with
+    //conjugate gradients preconditioned by that factorization, which gives the accuracy of
+    //DOUBLE with a float factorization; systems too ill conditioned for that to converge
+    //are factored again in double.  Curves of more than 256 values lose too much in a float
+    //system, so SINGLE assembles and factors those in double as well.  Defaults to MIXED.
+    enum Precision{SINGLE, MIXED, DOUBLE};
+    void setPrecision(Precision p);
+    Precision getPrecision()const;
+
+    //Number of threads that read the images of a stack concurrently, or 0 for as many as
+    //OpenMP would use.  Images are added to the systems in the same order whatever the
+    //number of threads, so it does not change the result.  Each thread holds at most one
+    //whole decoded image(when an image cannot be read sparsely), so this also bounds the
+    //memory used for decoding.  Defaults to 0.
+    void setNumDecodeThreads(size_t numThreads);
+    size_t getNumDecodeThreads()const;
+
+    //Curve the ITERATIVE solver starts from, such as a curve from CTF::loadCTF(...) for the
+    //same camera.  Without one, it starts from a constant curve.
+    void setInitialCTF(const CTF& ctf);
+    void clearInitialCTF();
+    bool hasInitialCTF()const;
+    const CTF& getInitialCTF()const;
+
+    //Types of possible sample position generators
+    //RANDOM draws positions uniformly at random.  STRATIFIED spreads positions evenly over
+    //the image and balances them across the pixel values of the middle exposure, so fewer
+    //samples are needed to constrain every part of the curve.
+    enum SamplingStrategy{RANDOM, STRATIFIED};
+    void setSamplingStrategy(SamplingStrategy strategy);
+    SamplingStrategy getSamplingStrategy()const;
+
+    //Level of the image pyramid to take samples from
+    //Level 0 is the full resolution image, and each level above it halves the resolution by
+    //averaging 2x2 blocks of the level below, so level L averages 2^L x 2^L blocks of pixels.
+    //Coarse levels are much cheaper to sample from large images, and averaging suppresses
+    //noise and small misregistrations between exposures.  Blocks that straddle a strong
+    //edge mix pixel values, so very coarse levels bias the curve; to refine a coarse
+    //curve, pass it to setInitialCTF(...) of an ITERATIVE solve at a finer level.
+    //Sample positions in PixelResults are the top left pixel of each sample's block.
+    void setPyramidLevel(size_t level);
+    size_t getPyramidLevel()const;
+
+    //Outlier rejection
+    //Before solving, samples whose pixel value falls by more than the monotonicity tolerance
+    //as exposure time increases are dropped; such samples landed on moving objects or
+    //misaligned edges.  A tolerance of a few pixel values absorbs sensor noise, and a
+    //negative tolerance, the default, keeps every sample.
+    void setMonotonicityTolerance(int tol);
+    int getMonotonicityTolerance()const;
+
+    //Robust refits
+    //After the first solve, the curve is refit this many times with each sample reweighted
+    //by how well it fits the previous curve(iteratively reweighted least squares), so
+    //outliers that pass the monotonicity check still lose their influence.  Defaults to 0.
+    //Joint solves and lambda sweeps only use the monotonicity check.
+    void setRobustIterations(size_t iters);
+    size_t getRobustIterations()const;
+
+    //Sensor bit depth
+    //Pixel values of a bits bit sensor run from 0 to 2^bits - 1, and the CTF gets an entry
+    //for each; values above that range are clamped.  8 and 16 bit images are both read,
+    //so 10, 12 and 14 bit sensors stored in the low bits of 16 bit files work as well.
+    //Defaults to 8, and may be at most 16.
+    void setBitDepth(int bits);
+    int getBitDepth()const;
+
+    //Number of pixel value bins
+    //Deep sensors have more pixel values than the samples can constrain, so consecutive
+    //pixel values can share CTF unknowns.  numBins must be a power of two no greater than
+    //2^bits, and 0, the default, gives every pixel value its own unknown.  The solved curve
+    //is interpolated back to 2^bits entries.
+    void setNumBins(size_t bins);
+    size_t getNumBins()const;
+
+    /// Number of CTF unknowns in the linear systems, numBins or 2^bits.
+    size_t getNumLevels()const;
+
+    //Largest number of CTF unknowns the dense solvers handle, since they factor a dense
+    //matrix of that size.  Solves with more use the ITERATIVE solver, and sweepLambdas(...),
+    //joint solves and COMPARAMETRIC are limited to it.  The COMPARAMETRIC solver only
+    //handles 8 bit images without binning.
+    static const size_t MAX_DENSE_LEVELS = 4096;
+
+    //Seed for the random number generator used to pick sample positions
+    //The same seed always gives the same sample positions
+    void setRandomSeed(unsigned long seedVal);
+    unsigned long getRandomSeed()const;
+
+    /**
+     *  Add another stack of exposures of a different scene, taken with the same camera, to
+     *  solve jointly with the images given to the constructor.  All stacks share the CTF
+     *  unknowns and each brings its own irradiance unknowns.  Each stack is sampled with
+     *  numSamps samples, and its images only need the same dimensions as each other.
+     *
+     *  Joint solves are done by solveChannels(...) and solve(...).  Sample irradiances are
+     *  not returned, and every sampled solver type uses the reduced system of the SCHUR
+     *  solver, since the stacks only couple through the CTF unknowns.  COMPARAMETRIC sums
+     *  the joint histograms of every stack, and POLYNOMIAL the normal equations of every
+     *  stack.  sweepLambdas(...) and incremental solves only use the constructor's images.
+     */
+    void addStack(const std::vector<ImageExposurePair>& images);
+    size_t getNumStacks()const;
+
     void setNumImageSamples(size_t numSamps);
     size_t getNumImageSamples()const;
 
@@ -80,17 +383,21 @@ public:
     size_t getChannelIndex()const;
     void setChannelIndex(size_t chanIndex);
 
-    /// Load a particular HDR stack and make sure all the images exist.
-    /// Also, return the width, height, and maximum color channels in the stack.
+    /// Check a particular HDR stack and make sure all the images exist.
+    /// Also, return the width, height, and minimum color channels in the stack.
+    /// Only the header of each image is read, unless its format is not one that
+    /// ImageProbe handles, in which case the image is loaded.
     ///
     /// @return true if all images exist and have the same dimensions.  Returns 
     /// false otherwise.
     /// @outWidth is set to the width of the images.
-    /// @outHeight is set to the width of the images.
+    /// @outHeight is set to the height of the images.
     /// @outMinNumChans is set to the minimum number of color channels found.
     /// @reason is a return parameter that describes errors(if any)
+    /// @outMaxBitDepth, if given, is set to the most bits per channel value found.
     static bool checkImagesOK(std::vector<CTFSolver::ImageExposurePair>& images,
-        int& outWidth, int& outHeight, int& outMinNumChans, std::string* reason = NULL);
+        int& outWidth, int& outHeight, int& outMinNumChans, std::string* reason = NULL,
+        int* outMaxBitDepth = NULL);
 
 
 private:
@@ -100,16 +407,57 @@ private:
 
     //Data
     std::vector<ImageExposurePair> imdata; //List of images along with exposure times
+    std::vector< std::vector<ImageExposurePair> > extraStacks; //More stacks to solve jointly with imdata
     CTF::ctf_t lambda; //Smoothing value
     size_t chan; //Color channel index
     size_t numSamples; //How many random samples to take from the image?
     WeightingFunc wFunc; //Which weighting function are we using?
+    SolverType solverType; //Which linear solver are we using?
+    SamplingStrategy sampling; //How do we pick sample positions?
+    unsigned long seed; //Random seed for picking sample positions
+    size_t pyramidLevel; //Pyramid level that samples are taken from
+    int monotonicityTolerance; //Largest allowed drop in a sample's values, or negative for no rejection
+    size_t robustIterations; //Number of reweighted refits
+    int bitDepth; //Bits per pixel value of the sensor
+    size_t numBins; //Number of CTF unknowns, or 0 for one per pixel value
+    CTF::ctf_t tolerance; //Convergence tolerance of the iterative solver
+    size_t maxIterations; //Iteration cap of the iterative solver
+    size_t polynomialDegree; //Degree of the polynomial solver's inverse response
+    Precision precision; //Precision of the dense curve solve
+    size_t numDecodeThreads; //Threads reading images, or 0 for the OpenMP default
+    CTF initialCTF; //Warm start for the iterative solver
+    bool useInitialCTF; //Is initialCTF set?
 
     //Helper functions
-    CTF::ctf_t hatFunc(unsigned char zVal)const;
-    CTF::ctf_t hatFuncParameterized(unsigned char zVal, unsigned char cut)const;
+    void makeWeightLUT(CTF::ctf_t* wLut, size_t numLevels)const;
+    int getBinShift()const;
+    void quantizeSamples(std::vector< std::vector<unsigned short> >& values)const;
+    void accumulateSamples(const std::vector<ImageExposurePair>& images,
+        const std::vector<size_t>& channels, const CTF::ctf_t* wLut,
+        std::vector<SamplePos>& outPositions, std::vector<size_t>& outOrder,
+        std::vector<CTFAccumulator>& outSystems, int* outWidth = NULL, int* outHeight = NULL,
+        std::vector<StageTime>* outDecodeTimes = NULL)const;
+    //These assemble the reduced curve system in Scalar, float or double, see setPrecision(...)
+    template<typename Scalar>
+    std::vector<CTF> solveComparametric(const std::vector<size_t>& channels,
+        const CTF::ctf_t* wLut, SolveStats* retStats)const;
+    template<typename Scalar>
+    std::vector<CTF> solveJoint(const std::vector<size_t>& channels,
+        const CTF::ctf_t* wLut, SolveStats* retStats)const;
+    CTF::ctf_t hatFunc(CTF::ctf_t z)const;
+    CTF::ctf_t hatFuncParameterized(CTF::ctf_t z, CTF::ctf_t cut)const;
 };
 
+inline size_t CTFSolver::IncrementalState::getNumExposures()const{
+    return exposures.size();
+}
+inline const std::vector<CTFSolver::ImageExposurePair>& CTFSolver::IncrementalState::getExposures()const{
+    return exposures;
+}
+inline const std::vector<size_t>& CTFSolver::IncrementalState::getChannels()const{
+    return channels;
+}
+
 inline void CTFSolver::setWeightingFunc(WeightingFunc func){
     wFunc = func;
 }
@@ -117,6 +465,125 @@ inline CTFSolver::WeightingFunc CTFSolver::getWeightingFunc()const{
     return wFunc;
 }
 
+inline void CTFSolver::setSolverType(SolverType type){
+    solverType = type;
+}
+inline CTFSolver::SolverType CTFSolver::getSolverType()const{
+    return solverType;
+}
+
+inline void CTFSolver::setTolerance(CTF::ctf_t tol){
+    tolerance = tol;
+}
+inline CTF::ctf_t CTFSolver::getTolerance()const{
+    return tolerance;
+}
+
+inline void CTFSolver::setMaxIterations(size_t maxIters){
+    maxIterations = maxIters;
+}
+inline size_t CTFSolver::getMaxIterations()const{
+    return maxIterations;
+}
+
+inline void CTFSolver::setPolynomialDegree(size_t degree){
+    assert(degree >= 1 && degree <= MAX_POLYNOMIAL_DEGREE);
+    polynomialDegree = degree;
+}
+inline size_t CTFSolver::getPolynomialDegree()const{
+    return polynomialDegree;
+}
+
+inline void CTFSolver::setPrecision(Precision p){
+    precision = p;
+}
+inline CTFSolver::Precision CTFSolver::getPrecision()const{
+    return precision;
+}
+
+inline void CTFSolver::setNumDecodeThreads(size_t numThreads){
+    numDecodeThreads = numThreads;
+}
+inline size_t CTFSolver::getNumDecodeThreads()const{
+    return numDecodeThreads;
+}
+
+inline void CTFSolver::setInitialCTF(const CTF& ctf){
+    initialCTF = ctf;
+    useInitialCTF = true;
+}
+inline void CTFSolver::clearInitialCTF(){
+    useInitialCTF = false;
+}
+inline bool CTFSolver::hasInitialCTF()const{
+    return useInitialCTF;
+}
+inline const CTF& CTFSolver::getInitialCTF()const{
+    return initialCTF;
+}
+
+inline void CTFSolver::setSamplingStrategy(SamplingStrategy strategy){
+    sampling = strategy;
+}
+inline CTFSolver::SamplingStrategy CTFSolver::getSamplingStrategy()const{
+    return sampling;
+}
+
+inline void CTFSolver::setRandomSeed(unsigned long seedVal){
+    seed = seedVal;
+}
+inline unsigned long CTFSolver::getRandomSeed()const{
+    return seed;
+}
+
+inline void CTFSolver::setPyramidLevel(size_t level){
+    pyramidLevel = level;
+}
+inline size_t CTFSolver::getPyramidLevel()const{
+    return pyramidLevel;
+}
+
+inline void CTFSolver::setMonotonicityTolerance(int tol){
+    monotonicityTolerance = tol;
+}
+inline int CTFSolver::getMonotonicityTolerance()const{
+    return monotonicityTolerance;
+}
+
+inline void CTFSolver::setRobustIterations(size_t iters){
+    robustIterations = iters;
+}
+inline size_t CTFSolver::getRobustIterations()const{
+    return robustIterations;
+}
+
+inline void CTFSolver::setBitDepth(int bits){
+    assert(bits >= 1 && bits <= 16);
+    bitDepth = bits;
+}
+inline int CTFSolver::getBitDepth()const{
+    return bitDepth;
+}
+
+inline void CTFSolver::setNumBins(size_t bins){
+    numBins = bins;
+}
+inline size_t CTFSolver::getNumBins()const{
+    return numBins;
+}
+
+inline size_t CTFSolver::getNumLevels()const{
+    return numBins > 0 ? numBins : (size_t(1) << bitDepth);
+}
+
+inline void CTFSolver::addStack(const std::vector<ImageExposurePair>& images){
+    assert(images.size() >= 2);
+    extraStacks.push_back(images);
+}
+inline size_t CTFSolver::getNumStacks()const{
+    return 1 + extraStacks.size();
+}
+
 inline void CTFSolver::setNumImageSamples(size_t numSamps){
     numSamples = numSamps;
 }
@@ -138,36 +605,28 @@ inline void CTFSolver::setChannelIndex(size_t chanIndex){
     chan = chanIndex;
 }
 
-inline CTF::ctf_t CTFSolver::hatFunc(unsigned char zVal)const{
-    /*
-    const CTF::ctf_t z = static_cast<CTF::ctf_t>(zVal);
+//The hat functions take pixel values rescaled to the 8 bit range [0, 255], so they have
+//the same shape at every bit depth
+inline CTF::ctf_t CTFSolver::hatFunc(CTF::ctf_t z)const{
     const CTF::ctf_t Z_MIN = static_cast<CTF::ctf_t>(0.0  );
     const CTF::ctf_t Z_MAX = static_cast<CTF::ctf_t>(255.0);
     assert(z >= Z_MIN && z <= Z_MAX);
-    return 
-        ((z <= (Z_MIN + Z_MAX)/static_cast<CTF::ctf_t>(2.0)) ? (z - Z_MIN) : 
+    return
+        ((z <= (Z_MIN + Z_MAX)/static_cast<CTF::ctf_t>(2.0)) ? (z - Z_MIN) :
         (Z_MAX - z));
-    */
-    return WeightingFunctions::hat(zVal);
 }
 
 
-inline CTF::ctf_t CTFSolver::hatFuncParameterized(unsigned char zVal,
-    unsigned char cut)const
-{
-    /*
-    assert(cut < 255);
+inline CTF::ctf_t CTFSolver::hatFuncParameterized(CTF::ctf_t z, CTF::ctf_t cut)const{
+    assert(cut < static_cast<CTF::ctf_t>(127.5));
 
-    const CTF::ctf_t z = static_cast<CTF::ctf_t>(zVal);
-    const CTF::ctf_t Z_MIN = static_cast<CTF::ctf_t>(cut  );
-    const CTF::ctf_t Z_MAX = static_cast<CTF::ctf_t>(255.0 - cut);
-    return (z <= Z_MIN || z >= Z_MAX) ? static_cast<CTF::ctf_t>(0.0) : 
+    const CTF::ctf_t Z_MIN = cut;
+    const CTF::ctf_t Z_MAX = static_cast<CTF::ctf_t>(255.0) - cut;
+    return (z <= Z_MIN || z >= Z_MAX) ? static_cast<CTF::ctf_t>(0.0) :
         (
-        ((z <= (Z_MIN + Z_MAX)/static_cast<CTF::ctf_t>(2.0)) ? (z - Z_MIN) : 
+        ((z <= (Z_MIN + Z_MAX)/static_cast<CTF::ctf_t>(2.0)) ? (z - Z_MIN) :
         (Z_MAX - z))
         );
-    */
-    return WeightingFunctions::hat(zVal, cut, 255-cut);
 }
 
 
@@ -0,0 +1,308 @@
+#include "ImageProbe.h"
+//--
+#include <cctype>
+#include <cstring>
+
+
+//Read n bytes, failing on a short read
+static bool readBytes(std::FILE* file, unsigned char* bytes, size_t n){
+    return std::fread(bytes, 1, n, file) == n;
+}
+
+static unsigned int bigEndian16(const unsigned char* bytes){
+    return (bytes[0] << 8) | bytes[1];
+}
+
+static unsigned long bigEndian32(const unsigned char* bytes){
+    return ((unsigned long)bytes[0] << 24) | ((unsigned long)bytes[1] << 16) |
+        ((unsigned long)bytes[2] << 8) | bytes[3];
+}
+
+//TIFF files store values in either byte order
+static unsigned int tiff16(const unsigned char* bytes, bool bigEndian){
+    return bigEndian ? bigEndian16(bytes) : (bytes[1] << 8) | bytes[0];
+}
+
+static unsigned long tiff32(const unsigned char* bytes, bool bigEndian){
+    return bigEndian ? bigEndian32(bytes) :
+        ((unsigned long)bytes[3] << 24) | ((unsigned long)bytes[2] << 16) |
+        ((unsigned long)bytes[1] << 8) | bytes[0];
+}
+
+//Fewest bits that hold every value up to maxVal
+static int bitsFor(unsigned long maxVal){
+    int bits = 1;
+    while(bits < 32 && (1ul << bits) - 1 < maxVal){
+        ++bits;
+    }
+    return bits;
+}
+
+
+bool ImageProbe::readPNMHeaderValue(std::FILE* file, long& value){
+    int ch = std::fgetc(file);
+    while(ch != EOF && (std::isspace(ch) || ch == '#')){
+        if(ch == '#'){
+            while(ch != EOF && ch != '\n'){
+                ch = std::fgetc(file);
+            }
+        }
+        ch = std::fgetc(file);
+    }
+    if(ch == EOF || !std::isdigit(ch)){
+        return false;
+    }
+
+    value = 0;
+    while(ch != EOF && std::isdigit(ch)){
+        value = value * 10 + (ch - '0');
+        ch = std::fgetc(file);
+    }
+
+    //Exactly one whitespace character ends the value
+    return ch != EOF && std::isspace(ch);
+}
+
+
+bool ImageProbe::probeBinaryPNM(std::FILE* file, int& outWidth, int& outHeight,
+    int& outNumChans, int& outBytesPerValue, long& outDataStart)
+{
+    unsigned char magic[2];
+    long width, height, maxVal;
+    if(!readBytes(file, magic, 2) || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6') ||
+        !readPNMHeaderValue(file, width) || !readPNMHeaderValue(file, height) ||
+        !readPNMHeaderValue(file, maxVal))
+    {
+        return false;
+    }
+    if(width <= 0 || height <= 0 || maxVal <= 0 || maxVal > 65535){
+        return false;
+    }
+
+    outWidth         = width;
+    outHeight        = height;
+    outNumChans      = magic[1] == '6' ? 3 : 1;
+    outBytesPerValue = maxVal > 255 ? 2 : 1;
+    outDataStart     = std::ftell(file);
+    return true;
+}
+
+
+//PGM(P2, P5) and PPM(P3, P6), positioned after the magic number
+static bool probePNM(std::FILE* file, bool color, ImageProbe::ImageInfo& outInfo){
+    long width, height, maxVal;
+    if(!ImageProbe::readPNMHeaderValue(file, width) ||
+        !ImageProbe::readPNMHeaderValue(file, height) ||
+        !ImageProbe::readPNMHeaderValue(file, maxVal))
+    {
+        return false;
+    }
+    if(width <= 0 || height <= 0 || maxVal <= 0 || maxVal > 65535){
+        return false;
+    }
+
+    outInfo.width    = width;
+    outInfo.height   = height;
+    outInfo.numChans = color ? 3 : 1;
+    outInfo.bitDepth = bitsFor(maxVal);
+    return true;
+}
+
+
+//PNG, positioned after the signature.  The IHDR chunk comes first; the chunks after it are
+//skipped over up to the image data, looking for a tRNS chunk.
+static bool probePNG(std::FILE* file, ImageProbe::ImageInfo& outInfo){
+    unsigned char ihdr[8 + 13];
+    if(!readBytes(file, ihdr, sizeof(ihdr)) || bigEndian32(ihdr) != 13 ||
+        std::memcmp(ihdr + 4, "IHDR", 4) != 0)
+    {
+        return false;
+    }
+    const unsigned long width  = bigEndian32(ihdr + 8);
+    const unsigned long height = bigEndian32(ihdr + 12);
+    const int bitDepth  = ihdr[16];
+    const int colorType = ihdr[17];
+    if(width == 0 || height == 0 || width > 0x7fffffff || height > 0x7fffffff){
+        return false;
+    }
+
+    //Skip the IHDR CRC, then each chunk's data and CRC
+    bool transparency = false;
+    long skip = 4;
+    unsigned char chunk[8];
+    while(std::fseek(file, skip, SEEK_CUR) == 0 && readBytes(file, chunk, 8)){
+        if(std::memcmp(chunk + 4, "IDAT", 4) == 0 || std::memcmp(chunk + 4, "IEND", 4) == 0){
+            break;
+        }
+        if(std::memcmp(chunk + 4, "tRNS", 4) == 0){
+            transparency = true;
+            break;
+        }
+        skip = (long)bigEndian32(chunk) + 4;
+    }
+
+    int numChans;
+    switch(colorType){
+        case 0: numChans = 1; break; //Gray
+        case 2: numChans = 3; break; //RGB
+        case 3: numChans = 3; break; //Palette, expanded to RGB
+        case 4: numChans = 2; break; //Gray and alpha
+        case 6: numChans = 4; break; //RGB and alpha
+        default: return false;
+    }
+    if(transparency && (colorType == 0 || colorType == 2 || colorType == 3)){
+        ++numChans;
+    }
+
+    outInfo.width    = width;
+    outInfo.height   = height;
+    outInfo.numChans = numChans;
+    outInfo.bitDepth = (colorType == 3 || bitDepth < 8) ? 8 : bitDepth;
+    return true;
+}
+
+
+//JPEG, positioned after the SOI marker.  Segments are skipped up to the start of frame.
+static bool probeJPEG(std::FILE* file, ImageProbe::ImageInfo& outInfo){
+    for(;;){
+        //A marker is 0xFF, any number of 0xFF fill bytes, then the marker code
+        int ch = std::fgetc(file);
+        if(ch != 0xFF){
+            return false;
+        }
+        while(ch == 0xFF){
+            ch = std::fgetc(file);
+        }
+        if(ch == EOF){
+            return false;
+        }
+        const int marker = ch;
+
+        //Markers without a segment
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)){
+            continue;
+        }
+
+        //The image data or its end, with no frame header before it
+        if(marker == 0xD9 || marker == 0xDA){
+            return false;
+        }
+
+        unsigned char length[2];
+        if(!readBytes(file, length, 2) || bigEndian16(length) < 2){
+            return false;
+        }
+
+        //Start of frame markers, other than DHT, JPG and DAC which share their range
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC){
+            unsigned char frame[6];
+            if(bigEndian16(length) < 8 || !readBytes(file, frame, 6)){
+                return false;
+            }
+            outInfo.bitDepth = frame[0];
+            outInfo.height   = bigEndian16(frame + 1);
+            outInfo.width    = bigEndian16(frame + 3);
+            outInfo.numChans = frame[5];
+
+            //A zero height is given later by a DNL marker, and CImg only loads JPEG files
+            //with 1, 3 or 4 components itself
+            return outInfo.width > 0 && outInfo.height > 0 &&
+                (outInfo.numChans == 1 || outInfo.numChans == 3 || outInfo.numChans == 4);
+        }
+
+        if(std::fseek(file, bigEndian16(length) - 2, SEEK_CUR) != 0){
+            return false;
+        }
+    }
+}
+
+
+//TIFF, positioned after the byte order mark.  Reads the tags of the first image.
+static bool probeTIFF(std::FILE* file, bool bigEndian, ImageProbe::ImageInfo& outInfo){
+    unsigned char bytes[12];
+    if(!readBytes(file, bytes, 6) || tiff16(bytes, bigEndian) != 42){
+        return false;
+    }
+    const unsigned long ifdOffset = tiff32(bytes + 2, bigEndian);
+    if(std::fseek(file, (long)ifdOffset, SEEK_SET) != 0 || !readBytes(file, bytes, 2)){
+        return false;
+    }
+    const unsigned int numEntries = tiff16(bytes, bigEndian);
+
+    //Defaults from the TIFF 6.0 specification
+    unsigned long width = 0, height = 0, samplesPerPixel = 1, bitsPerSample = 1;
+    unsigned long bitsOffset = 0;
+    for(unsigned int e = 0; e < numEntries; e++){
+        if(!readBytes(file, bytes, 12)){
+            return false;
+        }
+        const unsigned int tag   = tiff16(bytes, bigEndian);
+        const unsigned int type  = tiff16(bytes + 2, bigEndian);
+        const unsigned long count = tiff32(bytes + 4, bigEndian);
+
+        if(type != 3 && type != 4){
+            continue;
+        }
+
+        //SHORT(3) and LONG(4) values that fit in the entry are stored in it
+        const unsigned long value = type == 3 ? tiff16(bytes + 8, bigEndian) : tiff32(bytes + 8, bigEndian);
+        switch(tag){
+            case 256: width  = value; break;
+            case 257: height = value; break;
+            case 277: samplesPerPixel = value; break;
+            case 258:
+                //One value per sample, which is stored elsewhere when there are more than 2
+                if(type == 3 && count > 2){
+                    bitsOffset = tiff32(bytes + 8, bigEndian);
+                }else{
+                    bitsPerSample = value;
+                }
+                break;
+        }
+    }
+    if(bitsOffset != 0){
+        if(std::fseek(file, (long)bitsOffset, SEEK_SET) != 0 || !readBytes(file, bytes, 2)){
+            return false;
+        }
+        bitsPerSample = tiff16(bytes, bigEndian);
+    }
+
+    if(width == 0 || height == 0 || width > 0x7fffffff || height > 0x7fffffff ||
+        samplesPerPixel == 0 || bitsPerSample == 0 || bitsPerSample > 64)
+    {
+        return false;
+    }
+    outInfo.width    = width;
+    outInfo.height   = height;
+    outInfo.numChans = samplesPerPixel;
+    outInfo.bitDepth = bitsPerSample;
+    return true;
+}
+
+
+bool ImageProbe::probe(const std::string& path, ImageInfo& outInfo){
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if(file == NULL){
+        return false;
+    }
+
+    //Pick a prober from the magic number
+    unsigned char magic[8] = {0};
+    const size_t numMagic = std::fread(magic, 1, 8, file);
+    bool ok = false;
+    if(numMagic >= 2 && magic[0] == 'P' && magic[1] >= '2' && magic[1] <= '6' && magic[1] != '4'){
+        std::fseek(file, 2, SEEK_SET);
+        ok = probePNM(file, magic[1] == '3' || magic[1] == '6', outInfo);
+    }else if(numMagic == 8 && magic[0] == 0x89 && magic[1] == 'P' && magic[2] == 'N' && magic[3] == 'G'){
+        ok = probePNG(file, outInfo);
+    }else if(numMagic >= 2 && magic[0] == 0xFF && magic[1] == 0xD8){
+        std::fseek(file, 2, SEEK_SET);
+        ok = probeJPEG(file, outInfo);
+    }else if(numMagic >= 2 && ((magic[0] == 'I' && magic[1] == 'I') || (magic[0] == 'M' && magic[1] == 'M'))){
+        std::fseek(file, 2, SEEK_SET);
+        ok = probeTIFF(file, magic[0] == 'M', outInfo);
+    }
+
+    std::fclose(file);
+    return ok;
+}
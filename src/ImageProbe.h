@@ -0,0 +1,63 @@
+#ifndef IMAGE_PROBE_H
+#define IMAGE_PROBE_H
+
+#include <string>
+#include <cstdio>
+
+/**
+ *  Reads the dimensions, channel count and bit depth of an image from its file header,
+ *  without decoding any pixels.  Checking a stack this way costs a few small reads per
+ *  file rather than a full decode.
+ *
+ *  The format is picked from the magic number.  PGM and PPM(ASCII and binary), PNG, JPEG
+ *  and TIFF files are handled.  Channels are counted the way CImg counts them once the file
+ *  is loaded, so PNG palettes count as RGB and a PNG tRNS chunk adds an alpha channel.  The
+ *  bit depth is that of the values CImg loads, so palette and 1, 2 and 4 bit gray PNG files
+ *  are 8 bit.
+ */
+namespace ImageProbe{
+
+    /// What the header of an image file says about the image.
+    typedef struct ImageInfo{
+        ImageInfo() :
+            width(-1), height(-1), numChans(-1), bitDepth(-1){}
+        int width, height;
+        int numChans;
+        int bitDepth; //Bits per channel value
+    }ImageInfo;
+
+    /**
+     *  Read the header of an image file.
+     *
+     *  @param path is the image file to read.
+     *  @param outInfo is set to what the header says.  It is undefined when false is
+     *   returned.
+     *  @return true if the header was read, false if the file could not be opened, its
+     *   format is not handled, or its header is not valid.  The caller should then decode
+     *   the whole image with CImg, which reports why it cannot be loaded.
+     */
+    bool probe(const std::string& path, ImageInfo& outInfo);
+
+    /**
+     *  Read one unsigned integer from a PNM header, skipping whitespace and comments.
+     *  Exactly one whitespace character must end the value, and is consumed.
+     */
+    bool readPNMHeaderValue(std::FILE* file, long& value);
+
+    /**
+     *  Read the header of a binary PGM(P5) or PPM(P6) file, whose rows of raw values follow
+     *  it one after another.
+     *
+     *  @param file is positioned at the start of the file, and is left at the first row.
+     *  @param outBytesPerValue is set to 1, or to 2 for files with a maximum value over 255,
+     *   which store big endian 16 bit values.
+     *  @param outDataStart is set to the offset of the first row.
+     *  @return true if the header was read, false if this is not a binary PGM or PPM file or
+     *   its header is not valid.
+     */
+    bool probeBinaryPNM(std::FILE* file, int& outWidth, int& outHeight, int& outNumChans,
+        int& outBytesPerValue, long& outDataStart);
+}
+
+
+#endif //IMAGE_PROBE_H
@@ -0,0 +1,49 @@
+#ifndef IMAGE_VIEW_H
+#define IMAGE_VIEW_H
+
+#include <cstddef>
+
+/**
+ *  A read only view of 8 bit pixels owned by something else, such as a CImg image or a
+ *  MappedImage.  Copying a view does not copy the pixels.
+ *
+ *  Channels are either interleaved(as stored in PGM and PPM files) or stored as one plane
+ *  after another(as CImg stores them).  Accessors are named as CImg names them, so code
+ *  templated on the image type takes either a view or a CImg image.
+ */
+class ImageView{
+public:
+
+    /// \brief Create an empty view.
+    ImageView() :
+        pixels(NULL), w(0), h(0), chans(0), xStride(0), cStride(0){}
+
+    /**
+     *  @param data is the first value of the top left pixel.  It must stay valid for as
+     *   long as the view is used.
+     *  @param interleaved is true if the channels of each pixel are next to each other, and
+     *   false if each channel is a separate width x height plane.
+     */
+    ImageView(const unsigned char* data, int width, int height, int numChans, bool interleaved) :
+        pixels(data), w(width), h(height), chans(numChans),
+        xStride(interleaved ? numChans : 1),
+        cStride(interleaved ? 1 : (size_t)width * height){}
+
+    inline int width()const{ return w; }
+    inline int height()const{ return h; }
+    inline int spectrum()const{ return chans; }
+    inline bool is_empty()const{ return pixels == NULL; }
+
+    /// \brief Get the value of channel c of pixel (x,y).  z is ignored, as in a 2D CImg image.
+    inline const unsigned char& operator()(int x, int y, int z = 0, int c = 0)const{
+        return pixels[((size_t)y * w + x) * xStride + c * cStride];
+    }
+
+private:
+    const unsigned char* pixels;
+    int w, h, chans;
+    size_t xStride, cStride;
+};
+
+
+#endif //IMAGE_VIEW_H
@@ -0,0 +1,81 @@
+#include "MappedImage.h"
+//--
+#include <cstdio>
+//--
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+//--
+#include "ImageProbe.h"
+
+
+//Read the header of an 8 bit binary PGM or PPM file
+static bool readPNMHeader(const std::string& path, int& outWidth, int& outHeight,
+    int& outNumChans, long& outDataStart)
+{
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if(file == NULL){
+        return false;
+    }
+    int bytesPerValue;
+    const bool ok = ImageProbe::probeBinaryPNM(file, outWidth, outHeight, outNumChans,
+        bytesPerValue, outDataStart) && bytesPerValue == 1;
+    std::fclose(file);
+    return ok;
+}
+
+
+MappedImage::MappedImage() :
+    mapping(NULL), mappedSize(0)
+{}
+
+
+MappedImage::~MappedImage(){
+    close();
+}
+
+
+bool MappedImage::open(const std::string& path){
+    close();
+
+    int width, height, numChans;
+    long dataStart;
+    if(!readPNMHeader(path, width, height, numChans, dataStart)){
+        return false;
+    }
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+    struct stat fileStat;
+    const size_t rasterSize = (size_t)width * height * numChans;
+    if(fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < dataStart + rasterSize){
+        ::close(fd);
+        return false;
+    }
+
+    //The mapping keeps the file open, so the descriptor is not needed once it is made
+    void* mapped = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(mapped == MAP_FAILED){
+        return false;
+    }
+
+    mapping    = mapped;
+    mappedSize = fileStat.st_size;
+    view = ImageView(static_cast<const unsigned char*>(mapping) + dataStart,
+        width, height, numChans, true);
+    return true;
+}
+
+
+void MappedImage::close(){
+    if(mapping != NULL){
+        munmap(mapping, mappedSize);
+        mapping = NULL;
+        mappedSize = 0;
+    }
+    view = ImageView();
+}
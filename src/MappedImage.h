@@ -0,0 +1,54 @@
+#ifndef MAPPED_IMAGE_H
+#define MAPPED_IMAGE_H
+
+#include <string>
+#include <cstddef>
+//--
+#include "ImageView.h"
+
+/**
+ *  An 8 bit binary PGM or PPM file mapped into memory.  The raster of these files is
+ *  already laid out as a view needs it, so nothing is decoded or copied: pages of the file
+ *  are read by the OS the first time a pixel on them is touched, and sparse reads only
+ *  touch the pages they need.
+ *
+ *  Anything else, including 16 bit and ASCII files, is not handled and open() returns
+ *  false; the caller should then decode the whole image with CImg.
+ */
+class MappedImage{
+public:
+
+    MappedImage();
+    ~MappedImage();
+
+    /**
+     *  Map an image, unmapping any image already mapped.
+     *
+     *  @param path is the image file to map.
+     *  @return true if the image was mapped, false if it is not an 8 bit binary PGM or PPM
+     *   file, is shorter than its header says, or could not be mapped.
+     */
+    bool open(const std::string& path);
+
+    /// Unmap the image, if one is mapped.  Views of it must not be used afterwards.
+    void close();
+
+    /// \brief Get a view of the pixels, which is valid until the image is closed.
+    ImageView getView()const;
+
+    bool isOpen()const;
+
+private:
+    //Non-Copyable
+    MappedImage(const MappedImage& other);
+    MappedImage& operator=(const MappedImage& rhs);
+
+    void* mapping;
+    size_t mappedSize;
+    ImageView view;
+};
+
+inline ImageView MappedImage::getView()const{ return view; }
+inline bool MappedImage::isOpen()const{ return mapping != NULL; }
+
+#endif //MAPPED_IMAGE_H
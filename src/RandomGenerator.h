@@ -0,0 +1,49 @@
+#ifndef RANDOM_GENERATOR_H
+#define RANDOM_GENERATOR_H
+
+#include <cassert>
+#include <stdint.h>
+
+/**
+ *  Small seeded pseudo-random number generator(xorshift64*).
+ *  Unlike rand(), all state lives in the object, so separate generators can be used from
+ *  separate threads and a given seed always produces the same sequence.
+ */
+class RandomGenerator{
+public:
+
+    /// \brief Create a generator from a seed.  Any seed, including 0, is valid.
+    RandomGenerator(uint64_t seed = 0) :
+        state(seed * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL)
+    {
+        if(state == 0){ state = 0x2545F4914F6CDD1DULL; } //xorshift state must be non-zero
+    }
+
+    /// \brief Get the next 32 random bits.
+    inline uint32_t next(){
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return static_cast<uint32_t>((state * 0x2545F4914F6CDD1DULL) >> 32);
+    }
+
+    /// \brief Get a random integer in [minInclusive, maxExclusive).
+    inline int uniformInt(int minInclusive, int maxExclusive){
+        assert(maxExclusive > minInclusive);
+        const uint64_t range = static_cast<uint64_t>(maxExclusive - minInclusive);
+        const int val = minInclusive + static_cast<int>((next() * range) >> 32);
+        assert(val >= minInclusive && val < maxExclusive);
+        return val;
+    }
+
+    /// \brief Get a random float in [0, 1).
+    inline float uniformFloat(){
+        return static_cast<float>(next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+private:
+    uint64_t state;
+};
+
+
+#endif //RANDOM_GENERATOR_H
@@ -0,0 +1,135 @@
+#include "SampledImageReader.h"
+//--
+#include <cassert>
+#include <algorithm>
+//--
+#include "ScanlineReader.h"
+
+
+SampledImageReader::SampledImageReader(const std::vector<SamplePos>& positions, int blockSize) :
+    samples(positions), maxRowSamples(0), block(blockSize)
+{
+    assert(block >= 1);
+
+    //Group the samples by row
+    for(size_t i = 0; i < samples.size(); i++){
+        assert(i == 0 || !(samples[i] < samples[i-1]));
+        if(rows.empty() || rows.back().y != samples[i].y){
+            RowSpan span;
+            span.y = samples[i].y;
+            span.begin = span.end = i;
+            rows.push_back(span);
+        }
+        rows.back().end = i + 1;
+        maxRowSamples = std::max(maxRowSamples, rows.back().end - rows.back().begin);
+    }
+}
+
+
+bool SampledImageReader::read(const std::string& path, const std::vector<size_t>& channels,
+    std::vector< std::vector<unsigned short> >& outValues,
+    int& outWidth, int& outHeight)const
+{
+    ScanlineReader reader;
+    if(!reader.open(path)){
+        return false;
+    }
+    const int numChans = reader.getNumChans();
+    if(!prepare(reader.getWidth(), reader.getHeight(), numChans, channels, outValues)){
+        return false;
+    }
+    outWidth  = reader.getWidth() / block;
+    outHeight = reader.getHeight() / block;
+
+    //Only the rows holding samples are read.  PGM and PPM files seek straight to each one;
+    //other files are decoded in order, stopping after the last one.
+    const bool wide = reader.getBytesPerValue() == 2;
+    std::vector<unsigned char> rowData(reader.getRowBytes());
+    std::vector<unsigned int> sums(maxRowSamples * channels.size() + 1, 0);
+    for(size_t r = 0; r < rows.size(); r++){
+        if(!reader.skipTo(rows[r].y * block)){
+            return false;
+        }
+        for(int dy = 0; dy < block; dy++){
+            if(!reader.readRow(&(rowData[0]))){
+                return false;
+            }
+            addRow(r, &(rowData[0]), numChans, wide, channels, &(sums[0]));
+        }
+        finishRow(r, channels, &(sums[0]), outValues);
+    }
+
+    return true;
+}
+
+
+bool SampledImageReader::prepare(int width, int height, int numChans,
+    const std::vector<size_t>& channels,
+    std::vector< std::vector<unsigned short> >& outValues)const
+{
+    for(size_t c = 0; c < channels.size(); c++){
+        if(channels[c] >= (size_t)numChans){
+            return false;
+        }
+    }
+    if(!rows.empty() && rows.back().y >= height / block){
+        return false;
+    }
+    for(size_t i = 0; i < samples.size(); i++){
+        if(samples[i].x < 0 || samples[i].x >= width / block || samples[i].y < 0){
+            return false;
+        }
+    }
+
+    outValues.resize(channels.size());
+    for(size_t c = 0; c < channels.size(); c++){
+        outValues[c].resize(samples.size());
+    }
+    return true;
+}
+
+
+void SampledImageReader::addRow(size_t r, const unsigned char* rowData, int numChans, bool wide,
+    const std::vector<size_t>& channels, unsigned int* sums)const
+{
+    const size_t numChannels = channels.size();
+    unsigned int* sum = sums;
+    if(!wide){
+        for(size_t i = rows[r].begin; i < rows[r].end; i++){
+            const unsigned char* pixel = rowData + (size_t)samples[i].x * block * numChans;
+            for(int dx = 0; dx < block; dx++, pixel += numChans){
+                for(size_t c = 0; c < numChannels; c++){
+                    sum[c] += pixel[channels[c]];
+                }
+            }
+            sum += numChannels;
+        }
+        return;
+    }
+
+    for(size_t i = rows[r].begin; i < rows[r].end; i++){
+        const unsigned char* pixel = rowData + (size_t)samples[i].x * block * numChans * 2;
+        for(int dx = 0; dx < block; dx++, pixel += numChans * 2){
+            for(size_t c = 0; c < numChannels; c++){
+                const unsigned char* value = pixel + channels[c] * 2;
+                sum[c] += (value[0] << 8) | value[1];
+            }
+        }
+        sum += numChannels;
+    }
+}
+
+
+void SampledImageReader::finishRow(size_t r, const std::vector<size_t>& channels,
+    unsigned int* sums, std::vector< std::vector<unsigned short> >& outValues)const
+{
+    const unsigned int area = block * block;
+    unsigned int* sum = sums;
+    for(size_t i = rows[r].begin; i < rows[r].end; i++){
+        for(size_t c = 0; c < channels.size(); c++){
+            outValues[c][i] = static_cast<unsigned short>((sum[c] + area/2) / area);
+            sum[c] = 0;
+        }
+        sum += channels.size();
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef SAMPLED_IMAGE_READER_H
+#define SAMPLED_IMAGE_READER_H
+
+#include <string>
+#include <vector>
+
+/// A pixel position in an image.
+typedef struct SamplePos{
+    SamplePos(int xPos = -1, int yPos = -1) :
+        x(xPos), y(yPos){}
+    int x,y;
+
+    //Order by row, then column, so sorted samples are visited in memory order
+    bool operator<(const SamplePos& other)const{
+        return y < other.y || (y == other.y && x < other.x);
+    }
+}SamplePos;
+
+/**
+ *  Reads the pixel values at a fixed set of sample positions from image files, without
+ *  decoding the whole image.
+ *
+ *  Files are read with a ScanlineReader, which handles the same formats.  Binary PGM and
+ *  PPM files are read by seeking straight to each row that holds a sample.  PNG and JPEG
+ *  files are decoded one scanline at a time, and decoding stops after the last row that
+ *  holds a sample.  Files the ScanlineReader does not handle make read() return false; the
+ *  caller should then decode the whole image with CImg.
+ *
+ *  Samples can also be taken from a box filtered, downsampled copy of the image.  Each
+ *  sample is then the mean of a square block of pixels, which is accumulated while the rows
+ *  of the block are read, so the downsampled image is never stored.
+ */
+class SampledImageReader{
+public:
+
+    /**
+     *  @param positions are the sample positions, sorted by row then column(see
+     *   SamplePos::operator<).  They are in units of blocks when blockSize > 1.
+     *  @param blockSize is the side length of the block of pixels each sample averages.
+     *   Sample (x,y) is the mean of the block whose top left pixel is
+     *   (x * blockSize, y * blockSize), rounded to the nearest integer.
+     */
+    explicit SampledImageReader(const std::vector<SamplePos>& positions, int blockSize = 1);
+
+    /**
+     *  Read the values of some channels at every sample position.
+     *
+     *  @param path is the image file to read.
+     *  @param channels are the channels to read.
+     *  @param outValues is resized so that outValues[c][i] is the value of channels[c] at
+     *   sample i.
+     *  @param outWidth and outHeight are set to the dimensions of the image, in whole blocks.
+     *  @return true if the values were read, false if the file could not be read this way.
+     *   The contents of outValues are undefined when false is returned.
+     */
+    bool read(const std::string& path, const std::vector<size_t>& channels,
+        std::vector< std::vector<unsigned short> >& outValues,
+        int& outWidth, int& outHeight)const;
+
+    size_t getNumSamples()const;
+    int getBlockSize()const;
+
+private:
+
+    //A row of the image holding the samples in [begin, end)
+    typedef struct RowSpan{
+        int y;
+        size_t begin, end;
+    }RowSpan;
+
+    std::vector<SamplePos> samples;
+    std::vector<RowSpan> rows; //Rows of blocks
+    size_t maxRowSamples; //Most samples in any one row
+    int block;
+
+    //Check the samples and channels fit in the image, and size outValues
+    bool prepare(int width, int height, int numChans, const std::vector<size_t>& channels,
+        std::vector< std::vector<unsigned short> >& outValues)const;
+
+    //Add one interleaved row of pixels, from the blocks of row span r, to the per sample and
+    //channel sums, then write out the means and zero the sums once every row of the blocks
+    //has been added.  sums holds maxRowSamples * channels.size() zeroed entries.  Rows of
+    //16 bit images hold big endian values, as stored in PNM and PNG files.
+    void addRow(size_t r, const unsigned char* rowData, int numChans, bool wide,
+        const std::vector<size_t>& channels, unsigned int* sums)const;
+    void finishRow(size_t r, const std::vector<size_t>& channels, unsigned int* sums,
+        std::vector< std::vector<unsigned short> >& outValues)const;
+};
+
+inline size_t SampledImageReader::getNumSamples()const{ return samples.size(); }
+inline int SampledImageReader::getBlockSize()const{ return block; }
+
+#endif //SAMPLED_IMAGE_READER_H
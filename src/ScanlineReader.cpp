@@ -0,0 +1,302 @@
+#include "ScanlineReader.h"
+//--
+#include <cassert>
+#include <csetjmp>
+//--
+#include "ImageProbe.h"
+//--
+#ifdef cimg_use_png
+#include <png.h>
+#endif
+#ifdef cimg_use_jpeg
+#include <jpeglib.h>
+#endif
+
+
+#ifdef cimg_use_jpeg
+//libjpeg calls exit() on errors by default, so jump back to the reader instead
+typedef struct JPEGErrorManager{
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+}JPEGErrorManager;
+
+static void jpegErrorExit(j_common_ptr cinfo){
+    longjmp(reinterpret_cast<JPEGErrorManager*>(cinfo->err)->jump, 1);
+}
+
+static void jpegOutputMessage(j_common_ptr cinfo){
+    //Warnings are not printed; CImg reports them if the full decode is needed
+}
+#endif
+
+
+struct ScanlineReader::Decoder{
+#ifdef cimg_use_png
+    png_structp png;
+    png_infop info;
+#endif
+#ifdef cimg_use_jpeg
+    struct jpeg_decompress_struct cinfo;
+    JPEGErrorManager err;
+    bool jpegCreated;
+#endif
+};
+
+
+ScanlineReader::ScanlineReader() :
+    file(NULL), format(NONE), width(0), height(0), numChans(0), bytesPerValue(0), nextRow(0),
+    dataStart(0), decoder(NULL)
+{}
+
+
+ScanlineReader::~ScanlineReader(){
+    close();
+}
+
+
+bool ScanlineReader::open(const std::string& path){
+    close();
+    file = std::fopen(path.c_str(), "rb");
+    if(file == NULL){
+        return false;
+    }
+
+    //Pick a reader from the magic number
+    unsigned char magic[8] = {0};
+    const size_t numMagic = std::fread(magic, 1, 8, file);
+    bool ok = false;
+    if(numMagic >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6')){
+        std::fseek(file, 0, SEEK_SET);
+        ok = openPNM();
+    }else if(numMagic == 8 && magic[0] == 0x89 && magic[1] == 'P' && magic[2] == 'N' && magic[3] == 'G'){
+        ok = openPNG();
+    }else if(numMagic >= 2 && magic[0] == 0xFF && magic[1] == 0xD8){
+        std::fseek(file, 0, SEEK_SET);
+        ok = openJPEG();
+    }
+
+    if(!ok){
+        close();
+    }
+    return ok;
+}
+
+
+bool ScanlineReader::readRow(unsigned char* outRow){
+    if(format == NONE || nextRow >= height){
+        return false;
+    }
+
+    bool ok = false;
+    switch(format){
+        case PNM:
+            ok = std::fread(outRow, 1, getRowBytes(), file) == getRowBytes();
+            break;
+        case PNG:
+            ok = readPNGRow(outRow);
+            break;
+        case JPEG:
+            ok = readJPEGRow(outRow);
+            break;
+        default:
+            assert(false);
+            break;
+    }
+
+    if(ok){
+        ++nextRow;
+    }else{
+        close();
+    }
+    return ok;
+}
+
+
+bool ScanlineReader::skipTo(int y){
+    if(format == NONE || y < 0 || y >= height){
+        return false;
+    }
+
+    //Rows of PGM and PPM files are stored one after another
+    if(format == PNM){
+        if(std::fseek(file, dataStart + (long)(y * getRowBytes()), SEEK_SET) != 0){
+            close();
+            return false;
+        }
+        nextRow = y;
+        return true;
+    }
+
+    if(y < nextRow){
+        return false;
+    }
+    skipBuf.resize(getRowBytes());
+    while(nextRow < y){
+        if(!readRow(&(skipBuf[0]))){
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void ScanlineReader::close(){
+    closeDecoder();
+    if(file != NULL){
+        std::fclose(file);
+        file = NULL;
+    }
+    format = NONE;
+    width = height = numChans = bytesPerValue = nextRow = 0;
+    dataStart = 0;
+}
+
+
+bool ScanlineReader::openPNM(){
+    if(!ImageProbe::probeBinaryPNM(file, width, height, numChans, bytesPerValue, dataStart)){
+        return false;
+    }
+    format = PNM;
+    return true;
+}
+
+
+#ifdef cimg_use_png
+bool ScanlineReader::openPNG(){
+    decoder = new Decoder();
+    decoder->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(decoder->png == NULL){
+        return false;
+    }
+    decoder->info = png_create_info_struct(decoder->png);
+    if(decoder->info == NULL){
+        return false;
+    }
+    png_structp png = decoder->png;
+    png_infop info = decoder->info;
+    if(setjmp(png_jmpbuf(png))){
+        return false;
+    }
+
+    png_init_io(png, file);
+    png_set_sig_bytes(png, 8);
+    png_read_info(png, info);
+
+    //Apply the same expansions as CImg, so channels are numbered the same way.  CImg unpacks
+    //1, 2 and 4 bit gray rows with a different layout than it reads them in, so those files
+    //are left to CImg to get the same values.
+    const int colorType = png_get_color_type(png, info);
+    if(colorType == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(png, info) < 8){
+        return false;
+    }
+    if(colorType == PNG_COLOR_TYPE_PALETTE){
+        png_set_palette_to_rgb(png);
+    }
+    if(png_get_valid(png, info, PNG_INFO_tRNS)){
+        png_set_tRNS_to_alpha(png);
+    }
+    png_read_update_info(png, info);
+
+    const int bitDepth = png_get_bit_depth(png, info);
+    if((bitDepth != 8 && bitDepth != 16) ||
+        png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+    {
+        return false;
+    }
+    format   = PNG;
+    width    = png_get_image_width(png, info);
+    height   = png_get_image_height(png, info);
+    numChans = png_get_channels(png, info);
+    bytesPerValue = bitDepth / 8;
+    return true;
+}
+
+
+bool ScanlineReader::readPNGRow(unsigned char* outRow){
+    if(setjmp(png_jmpbuf(decoder->png))){
+        return false;
+    }
+    png_read_row(decoder->png, outRow, NULL);
+    return true;
+}
+#else
+bool ScanlineReader::openPNG(){
+    return false;
+}
+
+
+bool ScanlineReader::readPNGRow(unsigned char* outRow){
+    return false;
+}
+#endif
+
+
+#ifdef cimg_use_jpeg
+bool ScanlineReader::openJPEG(){
+    decoder = new Decoder();
+    decoder->jpegCreated = false;
+    struct jpeg_decompress_struct& cinfo = decoder->cinfo;
+    cinfo.err = jpeg_std_error(&(decoder->err.base));
+    decoder->err.base.error_exit     = jpegErrorExit;
+    decoder->err.base.output_message = jpegOutputMessage;
+    if(setjmp(decoder->err.jump)){
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    decoder->jpegCreated = true;
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+
+    if(cinfo.output_components != 1 && cinfo.output_components != 3 &&
+        cinfo.output_components != 4)
+    {
+        return false;
+    }
+    format   = JPEG;
+    width    = cinfo.output_width;
+    height   = cinfo.output_height;
+    numChans = cinfo.output_components;
+    bytesPerValue = 1;
+    return true;
+}
+
+
+bool ScanlineReader::readJPEGRow(unsigned char* outRow){
+    if(setjmp(decoder->err.jump)){
+        return false;
+    }
+    JSAMPROW rowPtr = outRow;
+    return jpeg_read_scanlines(&(decoder->cinfo), &rowPtr, 1) == 1;
+}
+#else
+bool ScanlineReader::openJPEG(){
+    return false;
+}
+
+
+bool ScanlineReader::readJPEGRow(unsigned char* outRow){
+    return false;
+}
+#endif
+
+
+void ScanlineReader::closeDecoder(){
+    if(decoder == NULL){
+        return;
+    }
+#ifdef cimg_use_png
+    if(decoder->png != NULL){
+        png_destroy_read_struct(&(decoder->png), &(decoder->info), NULL);
+    }
+#endif
+#ifdef cimg_use_jpeg
+    //Destroying the decompressor without finishing it abandons any remaining scanlines
+    if(decoder->jpegCreated){
+        jpeg_destroy_decompress(&(decoder->cinfo));
+    }
+#endif
+    delete decoder;
+    decoder = NULL;
+}
@@ -0,0 +1,102 @@
+#ifndef SCANLINE_READER_H
+#define SCANLINE_READER_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+/**
+ *  Reads an image one row at a time, from the top down, so only a row of it needs to be in
+ *  memory.  Several readers can be kept open at once to walk a stack of images in lock-step.
+ *
+ *  Binary PGM and PPM files are read directly, and can seek straight to any row.  PNG and
+ *  JPEG files are decoded one scanline at a time with libpng and libjpeg, and only when
+ *  CImg is set up to use those libraries(cimg_use_png and cimg_use_jpeg).  Both 8 and 16
+ *  bit PGM, PPM and PNG files are handled.  Anything else, including ASCII, interlaced and
+ *  1, 2 or 4 bit gray files, is not handled and open() returns false; the caller should
+ *  then decode the whole image with CImg.
+ *
+ *  This is the one place the rules for matching CImg live: channels are numbered the same
+ *  way CImg numbers them, and files CImg would load differently than libpng decodes them
+ *  are left to CImg.
+ */
+class ScanlineReader{
+public:
+
+    ScanlineReader();
+    ~ScanlineReader();
+
+    /**
+     *  Open an image and read its header, closing any image already open.
+     *
+     *  @param path is the image file to read.
+     *  @return true if the image can be read a row at a time, false otherwise.
+     */
+    bool open(const std::string& path);
+
+    /**
+     *  Read the next row of the image.
+     *
+     *  @param outRow is set to the row's values, with the getNumChans() values of each
+     *   pixel next to each other.  16 bit values are big endian, as stored in PNM and PNG
+     *   files.  It must hold getRowBytes() bytes.
+     *  @return true if the row was read, false if the image is not open, every row has
+     *   been read, or the file is damaged.  No more rows can be read after a failure.
+     */
+    bool readRow(unsigned char* outRow);
+
+    /**
+     *  Make row y the next row readRow(...) reads.  PGM and PPM files seek straight to it;
+     *  other files decode and drop the rows before it, so they can only skip forward.
+     *
+     *  @return true if row y is next, false if it is out of range, before the next row of
+     *   a file that cannot seek, or the file is damaged.
+     */
+    bool skipTo(int y);
+
+    /// Close the image, if one is open.
+    void close();
+
+    int getWidth()const;
+    int getHeight()const;
+    int getNumChans()const;
+    int getBytesPerValue()const; //1 for 8 bit images, 2 for 16 bit images
+    size_t getRowBytes()const;
+    int getNextRow()const; //Index of the row readRow(...) reads next
+
+private:
+    //Non-Copyable
+    ScanlineReader(const ScanlineReader& other);
+    ScanlineReader& operator=(const ScanlineReader& rhs);
+
+    enum Format{NONE, PNM, PNG, JPEG};
+
+    //libpng or libjpeg state, which is only defined where those libraries are used
+    struct Decoder;
+
+    std::FILE* file;
+    Format format;
+    int width, height, numChans, bytesPerValue;
+    int nextRow;
+    long dataStart; //Offset of the first row of PGM and PPM files
+    Decoder* decoder;
+    std::vector<unsigned char> skipBuf; //Rows dropped by skipTo(...)
+
+    //Per format openers.  PNG files are given the file positioned after the magic number,
+    //the others the file positioned at its start.
+    bool openPNM();
+    bool openPNG();
+    bool openJPEG();
+    bool readPNGRow(unsigned char* outRow);
+    bool readJPEGRow(unsigned char* outRow);
+    void closeDecoder();
+};
+
+inline int ScanlineReader::getWidth()const{ return width; }
+inline int ScanlineReader::getHeight()const{ return height; }
+inline int ScanlineReader::getNumChans()const{ return numChans; }
+inline int ScanlineReader::getBytesPerValue()const{ return bytesPerValue; }
+inline size_t ScanlineReader::getRowBytes()const{ return (size_t)width * numChans * bytesPerValue; }
+inline int ScanlineReader::getNextRow()const{ return nextRow; }
+
+#endif //SCANLINE_READER_H
@@ -0,0 +1,51 @@
+#ifndef STOPWATCH_H
+#define STOPWATCH_H
+
+#include <time.h>
+
+/**
+ *  Measures the wall clock time and CPU time since it was started.  CPU time is either that
+ *  of the whole process, summed over all threads, or that of the calling thread only, which
+ *  is what a stage running inside a parallel loop should be charged.
+ */
+class Stopwatch{
+public:
+
+    enum CPUClock{PROCESS, THREAD};
+
+    /// \brief Create a stopwatch and start it.
+    Stopwatch(CPUClock cpuClock = PROCESS) :
+        cpuClockId(cpuClock == PROCESS ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID)
+    {
+        restart();
+    }
+
+    /// \brief Start measuring again from now.
+    inline void restart(){
+        wallStart = now(CLOCK_MONOTONIC);
+        cpuStart  = now(cpuClockId);
+    }
+
+    /// \brief Get the wall clock seconds since the stopwatch was started.
+    inline double wallSeconds()const{
+        return now(CLOCK_MONOTONIC) - wallStart;
+    }
+
+    /// \brief Get the CPU seconds since the stopwatch was started.
+    inline double cpuSeconds()const{
+        return now(cpuClockId) - cpuStart;
+    }
+
+private:
+    clockid_t cpuClockId;
+    double wallStart, cpuStart;
+
+    static inline double now(clockid_t clockId){
+        timespec ts;
+        clock_gettime(clockId, &ts);
+        return ts.tv_sec + 1e-9 * ts.tv_nsec;
+    }
+};
+
+
+#endif //STOPWATCH_H
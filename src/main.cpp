@@ -4,28 +4,379 @@
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <algorithm>
+//--
+#include <sys/resource.h>
 //--
 #include "CTF.h"
 #include "CTFSolver.h"
+#include "Stopwatch.h"
+//--
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 static const int DFLT_NUM_SAMPS = 500;
 static const int DFLT_CHAN      = 0  ;
 static const double DFLT_LAMBDA = 3.0;
+static const unsigned long DFLT_SEED = 0;
+static const int DFLT_PYRAMID_LEVEL = 0;
+static const int DFLT_BIT_DEPTH = 8;
+static const int DFLT_ROBUST_ITERATIONS = 0;
+static const double DFLT_TOLERANCE = 1e-6;
+static const int DFLT_MAX_ITERATIONS = 1000;
+static const int DFLT_POLY_DEGREE = 3;
+static const int DFLT_DECODE_THREADS = 0;
+
+//Get the command line name of a solver
+static const char* solverName(CTFSolver::SolverType type){
+    switch(type){
+        case CTFSolver::SVD:             return "svd";
+        case CTFSolver::SPARSE_CHOLESKY: return "sparse";
+        case CTFSolver::SCHUR:           return "schur";
+        case CTFSolver::COMPARAMETRIC:   return "comparametric";
+        case CTFSolver::ITERATIVE:       return "iterative";
+        case CTFSolver::POLYNOMIAL:      return "polynomial";
+        default:                         return "unknown";
+    }
+}
+
+//Get the command line name of a precision
+static const char* precisionName(CTFSolver::Precision precision){
+    switch(precision){
+        case CTFSolver::SINGLE: return "single";
+        case CTFSolver::MIXED:  return "mixed";
+        case CTFSolver::DOUBLE: return "double";
+        default:                return "unknown";
+    }
+}
+
+//Get the warnings a solve's stats call for, one per problem per channel
+static std::vector<std::string> statsWarnings(const CTFSolver::SolveStats& stats,
+    const std::vector<size_t>& channels)
+{
+    std::vector<std::string> warnings;
+    for(size_t c = 0; c < channels.size(); c++){
+        const CTFSolver::SystemStats& sys = stats.channels[c];
+        std::stringstream prefix;
+        prefix << "Channel " << channels[c] << ": ";
+        if(sys.underdetermined){
+            warnings.push_back(prefix.str() + "too few samples to determine the curve without "
+                "smoothing; raise --num_samps.");
+        }
+        if(sys.smoothnessDominates){
+            warnings.push_back(prefix.str() + "the smoothness term outweighs the fitting term; "
+                "lower --lambda or raise --num_samps.");
+        }
+        if(sys.levelsWithoutData > 0){
+            std::stringstream ss;
+            ss << prefix.str() << sys.levelsWithoutData << " weighted pixel values were not taken "
+                "by any sample, and only follow the smoothness term.";
+            warnings.push_back(ss.str());
+        }
+        if(!(sys.conditionNumber < std::numeric_limits<double>::infinity())){
+            warnings.push_back(prefix.str() + "the system is singular.");
+        }
+    }
+    return warnings;
+}
+
+//Write a number as JSON, which has no infinities or NaNs; those become null
+static void writeJSONNumber(std::ostream& os, double val){
+    if(val == val && val - val == 0.0){
+        os << val;
+    }else{
+        os << "null";
+    }
+}
+
+//Write a stage's times as a JSON object
+static void writeJSONStage(std::ostream& os, const CTFSolver::StageTime& stage){
+    os << "{\"wall_seconds\": ";
+    writeJSONNumber(os, stage.wallSeconds);
+    os << ", \"cpu_seconds\": ";
+    writeJSONNumber(os, stage.cpuSeconds);
+    os << "}";
+}
+
+//Write a solve's stats as JSON.  Values that were not measured are null.
+static void writeStats(std::ostream& os, const CTFSolver& solver,
+    const CTFSolver::SolveStats& stats, const CTFSolver::StageTime& total,
+    const std::vector<size_t>& channels,
+    const std::vector<CTFSolver::ConvergenceInfo>& convergence,
+    const std::vector<std::string>& warnings)
+{
+    const double NOT_MEASURED = std::numeric_limits<double>::quiet_NaN();
+
+    rusage usage;
+    const double peakKB = getrusage(RUSAGE_SELF, &usage) == 0 ?
+        static_cast<double>(usage.ru_maxrss) : NOT_MEASURED;
+
+    os << std::setprecision(9);
+    os << "{" << std::endl;
+    os << "  \"solver\": \"" << solverName(solver.getSolverType()) << "\"," << std::endl;
+    os << "  \"precision\": \"" << precisionName(solver.getPrecision()) << "\"," << std::endl;
+    os << "  \"levels\": " << solver.getNumLevels() << "," << std::endl;
+    os << "  \"num_samples\": " << solver.getNumImageSamples() << "," << std::endl;
+    os << "  \"stages\": {" << std::endl;
+    os << "    \"decode\": ";        writeJSONStage(os, stats.decode);        os << "," << std::endl;
+    os << "    \"assembly\": ";      writeJSONStage(os, stats.assembly);      os << "," << std::endl;
+    os << "    \"factorization\": "; writeJSONStage(os, stats.factorization); os << "," << std::endl;
+    os << "    \"diagnostics\": ";   writeJSONStage(os, stats.diagnostics);   os << "," << std::endl;
+    os << "    \"total\": ";         writeJSONStage(os, total);               os << std::endl;
+    os << "  }," << std::endl;
+    os << "  \"image_decode\": [";
+    for(size_t j = 0; j < stats.imageDecode.size(); j++){
+        os << (j == 0 ? "" : ",") << std::endl << "    ";
+        writeJSONStage(os, stats.imageDecode[j]);
+    }
+    os << (stats.imageDecode.empty() ? "]," : "\n  ],") << std::endl;
+    os << "  \"peak_rss_kb\": ";
+    writeJSONNumber(os, peakKB);
+    os << "," << std::endl;
+    os << "  \"channels\": [" << std::endl;
+    for(size_t c = 0; c < channels.size(); c++){
+        const CTFSolver::SystemStats& sys = stats.channels[c];
+        os << "    {" << std::endl;
+        os << "      \"channel\": " << channels[c] << "," << std::endl;
+        os << "      \"rows\": " << sys.rows << "," << std::endl;
+        os << "      \"cols\": " << sys.cols << "," << std::endl;
+        os << "      \"nonzeros\": " << sys.nonzeros << "," << std::endl;
+        os << "      \"assembly\": ";      writeJSONStage(os, sys.assembly);      os << "," << std::endl;
+        os << "      \"factorization\": "; writeJSONStage(os, sys.factorization); os << "," << std::endl;
+        os << "      \"iterations\": " << convergence[c].iterations << "," << std::endl;
+        os << "      \"condition_number\": ";
+        writeJSONNumber(os, sys.conditionNumber > 0.0 ? sys.conditionNumber : NOT_MEASURED);
+        os << "," << std::endl;
+        os << "      \"fit_residual\": ";
+        writeJSONNumber(os, sys.fitResidual >= 0.0 ? sys.fitResidual : NOT_MEASURED);
+        os << "," << std::endl;
+        os << "      \"smoothness_residual\": ";
+        writeJSONNumber(os, sys.smoothnessResidual >= 0.0 ? sys.smoothnessResidual : NOT_MEASURED);
+        os << "," << std::endl;
+        os << "      \"levels_without_data\": " << sys.levelsWithoutData << "," << std::endl;
+        os << "      \"underdetermined\": " << (sys.underdetermined ? "true" : "false") << "," << std::endl;
+        os << "      \"smoothness_dominates\": " << (sys.smoothnessDominates ? "true" : "false") << std::endl;
+        os << "    }" << (c + 1 < channels.size() ? "," : "") << std::endl;
+    }
+    os << "  ]," << std::endl;
+    os << "  \"warnings\": [";
+    for(size_t w = 0; w < warnings.size(); w++){
+        os << (w == 0 ? "" : ",") << std::endl << "    \"" << warnings[w] << "\"";
+    }
+    os << (warnings.empty() ? "]" : "\n  ]") << std::endl;
+    os << "}" << std::endl;
+}
+
+//Write curves to a stream, with one column per curve
+static void writeCurves(std::ostream& os, const std::vector<CTF>& ctfs){
+    for(size_t pixVal = 0; pixVal < ctfs[0].getNumLevels(); pixVal++){
+        for(size_t c = 0; c < ctfs.size(); c++){
+            os << (c == 0 ? "" : " ") << ctfs[c].at(pixVal);
+        }
+        os << std::endl;
+    }
+}
+
+//Write a file, returning false on failure
+static bool writeCurveFile(const std::string& fileName, const std::vector<CTF>& ctfs){
+    std::fstream file(fileName.c_str(), std::fstream::out);
+    if(!file.good()){
+        file.close();
+        return false;
+    }
+    writeCurves(file, ctfs);
+    file << std::endl;
+    file.close();
+    return true;
+}
+
+//Parse a comma separated list of numbers, returning false on failure
+static bool parseLambdaList(const char* str, std::vector<CTF::ctf_t>& outVals){
+    outVals.clear();
+    const char* curr = str;
+    while(true){
+        char* end = NULL;
+        const double val = strtod(curr, &end);
+        if(end == curr || val < 0.0){
+            return false;
+        }
+        outVals.push_back(static_cast<CTF::ctf_t>(val));
+        if(*end == '\0'){
+            return true;
+        }else if(*end != ','){
+            return false;
+        }
+        curr = end + 1;
+    }
+}
+
+//Is arg one of the options that are not followed by a value?
+static bool isFlagOption(const char* arg){
+    return strcmp(arg,"--all_channels") == 0 || strcmp(arg,"--split_channels") == 0 ||
+        strcmp(arg,"--incremental") == 0 || strcmp(arg,"--silent") == 0;
+}
+
+//Read one "--num_files N file_1 time_1 ... file_N time_N" list starting at index, leaving
+//index just past it.  Returns 0 on success, or the exit code to use after printing an error.
+static int readImageList(int argc, char** argv, int& index,
+    std::vector<CTFSolver::ImageExposurePair>& images)
+{
+    //Make sure we just landed on the --num_files argument
+    if(index >= argc || strcmp(argv[index],"--num_files") != 0){
+        std::cerr << "Error - Missing --num_files argument." << std::endl;
+        return 1;
+    }
+    if(++index >= argc){
+        std::cerr << "Error - Missing number of files after --num_files." << std::endl;
+        return 1;
+    }
+    const int numFiles = atoi(argv[index++]);
+    if(numFiles < 2){
+        std::cerr << "Error - At least 2 images required!" << std::endl;
+        return 2;
+    }
+
+    //Read the image/time pairs
+    for(int i = 0; i < numFiles; i++){
 
-//app [OPTIONS] --num_files N  file_1 time_1 .... file_N time_N
+        //make sure we don't read too far
+        if(index + 1 >= argc){
+            std::cerr << "Error - Could not read all: " << numFiles <<
+                " files from the command line." << std::endl;
+            return 3;
+        }
+
+        //Read the pair
+        std::string path(argv[index++]);
+        double time = strtod(argv[index++], NULL);
+        images.push_back(CTFSolver::ImageExposurePair(time,path));
+    }
+    return 0;
+}
+
+//One line of a batch manifest: a stack of images of one camera, and the channel to solve
+typedef struct BatchEntry{
+    std::string cameraId;
+    size_t channel;
+    std::vector<CTFSolver::ImageExposurePair> images;
+}BatchEntry;
+
+//Read a batch manifest, returning false on failure.  Each non-empty line that does not
+//start with '#' is "camera_id channel file_1 time_1 ... file_N time_N".
+static bool readBatchManifest(const std::string& fileName, std::vector<BatchEntry>& outEntries,
+    std::string& outError)
+{
+    std::ifstream file(fileName.c_str());
+    if(!file.good()){
+        outError = "Could not open the manifest file.";
+        return false;
+    }
+
+    std::string line;
+    for(int lineNum = 1; std::getline(file, line); lineNum++){
+        std::stringstream ss(line);
+        BatchEntry entry;
+        if(!(ss >> entry.cameraId) || entry.cameraId[0] == '#'){
+            continue;
+        }
+
+        //Read the channel, then the image/time pairs
+        std::stringstream err;
+        err << "Line " << lineNum << ": ";
+        long channel = -1;
+        if(!(ss >> channel) || channel < 0){
+            err << "Missing or invalid channel.";
+            outError = err.str();
+            return false;
+        }
+        entry.channel = static_cast<size_t>(channel);
+        std::string path;
+        double time;
+        while(ss >> path){
+            if(!(ss >> time)){
+                err << "Missing exposure time for " << path << ".";
+                outError = err.str();
+                return false;
+            }
+            entry.images.push_back(CTFSolver::ImageExposurePair(time,path));
+        }
+        if(entry.images.size() < 2){
+            err << "At least 2 images required!";
+            outError = err.str();
+            return false;
+        }
+        outEntries.push_back(entry);
+    }
+    return true;
+}
+
+//Apply the solver options shared by every solve
+static void configureSolver(CTFSolver& solver, CTFSolver::WeightingFunc wFunc,
+    CTFSolver::SolverType solverType, CTFSolver::SamplingStrategy sampling,
+    unsigned long seed, size_t pyramidLevel, int bitDepth, int numBins,
+    int monotonicityTolerance, int robustIterations, double tolerance, int maxIterations,
+    int polyDegree, CTFSolver::Precision precision, int decodeThreads, const CTF* initialCTF)
+{
+    solver.setWeightingFunc(wFunc);
+    solver.setSolverType(solverType);
+    solver.setSamplingStrategy(sampling);
+    solver.setRandomSeed(seed);
+    solver.setPyramidLevel(pyramidLevel);
+    solver.setBitDepth(bitDepth);
+    solver.setNumBins(numBins);
+    solver.setMonotonicityTolerance(monotonicityTolerance);
+    solver.setRobustIterations(robustIterations);
+    solver.setTolerance(tolerance);
+    solver.setMaxIterations(maxIterations);
+    solver.setPolynomialDegree(polyDegree);
+    solver.setPrecision(precision);
+    solver.setNumDecodeThreads(decodeThreads);
+    if(initialCTF != NULL){
+        solver.setInitialCTF(*initialCTF);
+    }
+}
+
+//app [OPTIONS] --num_files N  file_1 time_1 .... file_N time_N [--num_files M ...]
 //
 //Valid options
 //    --help
 //    --num_samps INT
 //    --lambda FLOAT
+//    --lambda_sweep FLOAT,FLOAT,...
 //    --weighting_func  {hat,uniform}
+//    --solver {svd,sparse,schur,comparametric,iterative,polynomial}
+//    --tolerance FLOAT
+//    --max_iterations INT
+//    --initial_ctf fileName
+//    --precision {single,mixed,double}
+//    --decode_threads INT
+//    --sampling {random,stratified}
+//    --seed INT
+//    --pyramid_level INT
+//    --bit_depth INT
+//    --num_bins INT
+//    --reject_outliers INT
+//    --robust_iterations INT
+//    --all_channels
+//    --split_channels
+//    --batch fileName
+//    --incremental
+//    --stats fileName
 //    --silent
 int main(int argc, char** argv){
 
     //Check for help message
     if(argc > 1 && strcmp(argv[1],"--help") ==  0){
         std::cout << "Usage: " << std::endl << 
-            argv[0] << " [OPTIONS] --num_files N  file_1 time_1 ... file_N time_N" << std::endl;
+            argv[0] << " [OPTIONS] --num_files N  file_1 time_1 ... file_N time_N [--num_files M ...]" << std::endl;
+        std::cout << "Each extra --num_files list is another scene taken with the same camera, and the" << std::endl;
+        std::cout << "curve is solved jointly over all of them." << std::endl;
+        std::cout << "Or, to calibrate many cameras at once: " << std::endl <<
+            argv[0] << " [OPTIONS] --batch manifestFile --out_file fileName" << std::endl;
         std::cout << "OPTIONS include: "        << std::endl;
         std::cout << "\t--help"                 << std::endl;
         std::cout << "\t\tPrint this usage information." << std::endl;
@@ -34,20 +385,99 @@ int main(int argc, char** argv){
         std::cout << "\t--bloom_discard INTEGER" << std::endl;
         std::cout << "\t--lambda FLOAT"         << std::endl;
         std::cout << "\t\tSmoothing coeffecient.  Defaults to " << DFLT_LAMBDA << std::endl;
+        std::cout << "\t--lambda_sweep FLOAT,FLOAT,..." << std::endl;
+        std::cout << "\t\tSolve once for every listed smoothing coefficient instead of --lambda." << std::endl;
+        std::cout << "\t\tThe images are only read once and all the solves share one decomposition." << std::endl;
+        std::cout << "\t\tCurves are written with one column per smoothing coefficient, and a" << std::endl;
+        std::cout << "\t\tcross-validation error(smaller is better) is printed for each one unless --silent." << std::endl;
+        std::cout << "\t\tCannot be used with the comparametric or polynomial solvers or --out_file_points." << std::endl;
         std::cout << "\t--weight_func {hat, hat_10}" << std::endl;
         std::cout << "\t\tDefaults to \"hat,\" the function used in Debevec and Malik 1997." << std::endl;
         std::cout << "\t\that uses a triangle filter that starts at 0 and ends at 255." << std::endl;
         std::cout << "\t\that_10 w uses with 0 weight on the upper and lower 10 values." << std::endl;
+        std::cout << "\t--solver {svd, sparse, schur, comparametric, iterative, polynomial}" << std::endl;
+        std::cout << "\t\tDefaults to \"svd,\" a dense SVD of the full linear system as in Debevec and Malik 1997." << std::endl;
+        std::cout << "\t\tsparse solves the normal equations of the sparse system with a Cholesky factorization." << std::endl;
+        std::cout << "\t\tsparse is much faster and uses much less memory for large sample counts." << std::endl;
+        std::cout << "\t\tschur eliminates the per-sample unknowns as the system is built, leaving one unknown per pixel value." << std::endl;
+        std::cout << "\t\tschur is the fastest, and its cost barely grows with the sample count." << std::endl;
+        std::cout << "\t\tcomparametric fits the curve to joint histograms of adjacent exposures, using every pixel." << std::endl;
+        std::cout << "\t\tWith comparametric, --num_samps only sets how strongly the data is weighted against lambda." << std::endl;
+        std::cout << "\t\titerative runs conjugate gradients on the system without storing it, using memory linear" << std::endl;
+        std::cout << "\t\tin the sample count.  It is fast when started from a good curve with --initial_ctf." << std::endl;
+        std::cout << "\t\tpolynomial fits a low degree polynomial inverse response(Mitsunaga and Nayar 1999) for a" << std::endl;
+        std::cout << "\t\tquick calibration from few samples.  It ignores --lambda." << std::endl;
+        std::cout << "\t--poly_degree INTEGER" << std::endl;
+        std::cout << "\t\tDegree of the polynomial solver's inverse response, up to " << CTFSolver::MAX_POLYNOMIAL_DEGREE << ".  Defaults to " << DFLT_POLY_DEGREE << std::endl;
+        std::cout << "\t--tolerance FLOAT" << std::endl;
+        std::cout << "\t\tWith the iterative solver, stop once the relative residual is below this.  Defaults to " << DFLT_TOLERANCE << std::endl;
+        std::cout << "\t--max_iterations INTEGER" << std::endl;
+        std::cout << "\t\tWith the iterative solver, stop after this many iterations.  Defaults to " << DFLT_MAX_ITERATIONS << std::endl;
+        std::cout << "\t--initial_ctf fileName" << std::endl;
+        std::cout << "\t\tWith the iterative solver, start from this curve, such as an earlier result for the same camera." << std::endl;
+        std::cout << "\t--precision {single, mixed, double}" << std::endl;
+        std::cout << "\t\tPrecision of the curve solve of the sparse, schur and comparametric solvers.  Defaults to" << std::endl;
+        std::cout << "\t\t\"mixed,\" which builds the system in double precision, factors it in single precision and" << std::endl;
+        std::cout << "\t\trefines the curve in double precision, or factors in double precision when refinement cannot" << std::endl;
+        std::cout << "\t\tconverge.  \"single\" builds and solves in single precision, except for curves of more than 256 values," << std::endl;
+        std::cout << "\t\twhich it builds and solves in double precision." << std::endl;
+        std::cout << "\t--decode_threads INTEGER" << std::endl;
+        std::cout << "\t\tRead this many images at once.  Defaults to 0, one per core.  Each thread may hold a whole" << std::endl;
+        std::cout << "\t\tdecoded image, so lower this to bound memory on very large images." << std::endl;
+        std::cout << "\t--sampling {random, stratified}" << std::endl;
+        std::cout << "\t\tDefaults to \"stratified,\" which spreads samples evenly over the image and over" << std::endl;
+        std::cout << "\t\tthe pixel values of the middle exposure.  random draws samples uniformly at random." << std::endl;
+        std::cout << "\t--seed INTEGER" << std::endl;
+        std::cout << "\t\tRandom seed for picking samples.  Defaults to " << DFLT_SEED << std::endl;
+        std::cout << "\t--pyramid_level INTEGER" << std::endl;
+        std::cout << "\t\tTake samples from images box filtered down by 2^INTEGER in each dimension.  Defaults to 0(full resolution)." << std::endl;
+        std::cout << "\t\tMuch faster on very large images; refine with --solver iterative --initial_ctf at a finer level if needed." << std::endl;
+        std::cout << "\t\tAt most 8." << std::endl;
+        std::cout << "\t--bit_depth INTEGER" << std::endl;
+        std::cout << "\t\tBits per pixel value of the sensor, up to 16.  Defaults to " << DFLT_BIT_DEPTH << std::endl;
+        std::cout << "\t\tThe curve gets 2^INTEGER entries.  Deeper sensors are read from 16 bit PGM, PPM or PNG files," << std::endl;
+        std::cout << "\t\twith values in the low bits.  Curves of more than " << CTFSolver::MAX_DENSE_LEVELS << " values are solved iteratively, and" << std::endl;
+        std::cout << "\t\tcurves of more than 256 values use the schur solver in place of svd." << std::endl;
+        std::cout << "\t--num_bins INTEGER" << std::endl;
+        std::cout << "\t\tSolve for this many curve values, each shared by a run of pixel values, and interpolate" << std::endl;
+        std::cout << "\t\tbetween them.  A power of two no greater than 2^bit_depth.  Defaults to one per pixel value." << std::endl;
+        std::cout << "\t\tThe comparametric solver only handles 8 bit sensors without bins, and --lambda_sweep and" << std::endl;
+        std::cout << "\t\tseveral stacks are limited to " << CTFSolver::MAX_DENSE_LEVELS << " curve values." << std::endl;
+        std::cout << "\t--reject_outliers INTEGER" << std::endl;
+        std::cout << "\t\tDrop samples whose value falls by more than INTEGER as exposure time increases(moving objects, misaligned edges)." << std::endl;
+        std::cout << "\t--robust_iterations INTEGER" << std::endl;
+        std::cout << "\t\tRefit the curve this many times, down-weighting samples that fit it poorly.  Defaults to " << DFLT_ROBUST_ITERATIONS << std::endl;
+        std::cout << "\t--all_channels" << std::endl;
+        std::cout << "\t\tSolve for the curve of every color channel in a single pass over the images." << std::endl;
+        std::cout << "\t\tCurves are written as one file with one column per channel." << std::endl;
+        std::cout << "\t--split_channels" << std::endl;
+        std::cout << "\t\tWith --all_channels, write the curve of channel C to \"fileName.C\" instead." << std::endl;
+        std::cout << "\t--batch manifestFile" << std::endl;
+        std::cout << "\t\tSolve every stack listed in manifestFile, in parallel, instead of the --num_files list." << std::endl;
+        std::cout << "\t\tEach line is \"camera_id channel file_1 time_1 ... file_N time_N\"; lines starting with '#' are skipped." << std::endl;
+        std::cout << "\t\tThe curve of each line is written to \"fileName.camera_id.channel\", where fileName is from --out_file." << std::endl;
+        std::cout << "\t\tCannot be used with --lambda_sweep, --all_channels or --out_file_points." << std::endl;
+        std::cout << "\t--incremental" << std::endl;
+        std::cout << "\t\tAdd the images one at a time, in the order given, and solve after each one, as when" << std::endl;
+        std::cout << "\t\tcalibrating during a capture.  Only the samples of each new image are read.  Samples are" << std::endl;
+        std::cout << "\t\tpicked from the first image, so list a middle exposure first.  With the iterative solver each" << std::endl;
+        std::cout << "\t\tsolve starts from the last curve.  Cannot be used with --lambda_sweep, --batch, --stats, --out_file_points or several stacks." << std::endl;
         std::cout << "\t--out_file fileName"    << std::endl;
         std::cout << "\t\tFile to write CTF data to.  Defaults to writing to stdout if this is not specified" << std::endl;
         std::cout << "\t--out_file_points fileName"    << std::endl;
         std::cout << "\t\tFile to write raw points used in solve to." << std::endl;
+        std::cout << "\t--stats fileName" << std::endl;
+        std::cout << "\t\tWrite timing and diagnostics of the solve to fileName as JSON(\"-\" for stdout): the time of" << std::endl;
+        std::cout << "\t\teach stage and of reading each image, peak memory, the system's size, condition number and" << std::endl;
+        std::cout << "\t\tresiduals, and warnings such as too few samples, which are also printed.  Estimating the" << std::endl;
+        std::cout << "\t\tcondition number costs another factorization.  Cannot be used with --lambda_sweep or --batch." << std::endl;
+        std::cout << "\t\tWriting to stdout requires --silent, so nothing else is printed there." << std::endl;
         std::cout << "\t--silent" << std::endl;
         std::cout << "\t\tIf specified, we only write(or print) the CTF and do nothing else." << std::endl;
         return 0;
     }
 
-    //Check for improper arg count
+    //Check for improper arg count(a batch needs at least "--batch f --out_file f")
     if(argc < 5){
         std::cerr << "Invalid number of arguments." << std::endl;
         std::cerr << "See " << argv[0] << " --help" << std::endl;
@@ -58,17 +488,52 @@ int main(int argc, char** argv){
     int index = 1;
     int numSamps = DFLT_NUM_SAMPS;
     double lambda = DFLT_LAMBDA;
+    std::vector<CTF::ctf_t> lambdas;
     int chan = DFLT_CHAN;
     bool silent = false;
     std::string outFile("-");
     std::string outFilePoints("");
+    std::string statsFile("");
     CTFSolver::WeightingFunc wFunc = CTFSolver::HAT;
-    while(strcmp(argv[index],"--num_files") != 0 && index < argc){
+    CTFSolver::SolverType solverType = CTFSolver::SVD;
+    CTFSolver::SamplingStrategy sampling = CTFSolver::STRATIFIED;
+    unsigned long seed = DFLT_SEED;
+    int pyramidLevel = DFLT_PYRAMID_LEVEL;
+    int bitDepth = DFLT_BIT_DEPTH;
+    int numBins = 0;
+    int monotonicityTolerance = -1;
+    int robustIterations = DFLT_ROBUST_ITERATIONS;
+    double tolerance = DFLT_TOLERANCE;
+    int maxIterations = DFLT_MAX_ITERATIONS;
+    int decodeThreads = DFLT_DECODE_THREADS;
+    int polyDegree = DFLT_POLY_DEGREE;
+    CTFSolver::Precision precision = CTFSolver::MIXED;
+    std::string initialCTFFile("");
+    bool allChannels = false;
+    bool splitChannels = false;
+    bool incremental = false;
+    std::string batchFile("");
+    while(index < argc && strcmp(argv[index],"--num_files") != 0){
         char* arg = argv[index++];
+        if(!isFlagOption(arg) && index >= argc){
+            std::cerr << "Error - Missing value after " << arg << "." << std::endl;
+            std::cerr << "See " << argv[0] << " --help" << std::endl;
+            return 1;
+        }
         if(strcmp(arg,"--num_samps")    == 0){
             numSamps = atoi(argv[index++]);
+            if(numSamps < 1){
+                std::cerr << "Invalid number of samples: " << numSamps << std::endl;
+                return 2;
+            }
         }else if(strcmp(arg,"--lambda") == 0){
             lambda = strtod(argv[index++], NULL);
+        }else if(strcmp(arg,"--lambda_sweep") == 0){
+            char* lambdaList = argv[index++];
+            if(!parseLambdaList(lambdaList, lambdas)){
+                std::cerr << "Invalid smoothing coefficient list: " << lambdaList << std::endl;
+                return 2;
+            }
         }else if(strcmp(arg,"--weight_func") == 0){
             char* wFuncName = argv[index++];
             if(strcmp(wFuncName, "hat") == 0){
@@ -79,6 +544,106 @@ int main(int argc, char** argv){
                 std::cerr << "Unknown weighting function: " << wFuncName << std::endl;
                 return 2;
             }
+        }else if(strcmp(arg,"--solver") == 0){
+            char* solverName = argv[index++];
+            if(strcmp(solverName, "svd") == 0){
+                solverType = CTFSolver::SVD;
+            }else if(strcmp(solverName,"sparse") == 0){
+                solverType = CTFSolver::SPARSE_CHOLESKY;
+            }else if(strcmp(solverName,"schur") == 0){
+                solverType = CTFSolver::SCHUR;
+            }else if(strcmp(solverName,"comparametric") == 0){
+                solverType = CTFSolver::COMPARAMETRIC;
+            }else if(strcmp(solverName,"iterative") == 0){
+                solverType = CTFSolver::ITERATIVE;
+            }else if(strcmp(solverName,"polynomial") == 0){
+                solverType = CTFSolver::POLYNOMIAL;
+            }else{
+                std::cerr << "Unknown solver: " << solverName << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--tolerance") == 0){
+            tolerance = strtod(argv[index++], NULL);
+        }else if(strcmp(arg,"--max_iterations") == 0){
+            maxIterations = atoi(argv[index++]);
+        }else if(strcmp(arg,"--poly_degree") == 0){
+            polyDegree = atoi(argv[index++]);
+            if(polyDegree < 1 || polyDegree > (int)CTFSolver::MAX_POLYNOMIAL_DEGREE){
+                std::cerr << "Invalid polynomial degree: " << polyDegree << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--initial_ctf") == 0){
+            char* f = argv[index++];
+            initialCTFFile = std::string(f);
+        }else if(strcmp(arg,"--precision") == 0){
+            char* precisionName = argv[index++];
+            if(strcmp(precisionName, "single") == 0){
+                precision = CTFSolver::SINGLE;
+            }else if(strcmp(precisionName, "mixed") == 0){
+                precision = CTFSolver::MIXED;
+            }else if(strcmp(precisionName, "double") == 0){
+                precision = CTFSolver::DOUBLE;
+            }else{
+                std::cerr << "Unknown precision: " << precisionName << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--decode_threads") == 0){
+            decodeThreads = atoi(argv[index++]);
+            if(decodeThreads < 0){
+                std::cerr << "Invalid number of decode threads: " << decodeThreads << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--sampling") == 0){
+            char* samplingName = argv[index++];
+            if(strcmp(samplingName, "random") == 0){
+                sampling = CTFSolver::RANDOM;
+            }else if(strcmp(samplingName,"stratified") == 0){
+                sampling = CTFSolver::STRATIFIED;
+            }else{
+                std::cerr << "Unknown sampling strategy: " << samplingName << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--seed") == 0){
+            seed = strtoul(argv[index++], NULL, 10);
+        }else if(strcmp(arg,"--pyramid_level") == 0){
+            pyramidLevel = atoi(argv[index++]);
+            if(pyramidLevel < 0 || pyramidLevel > 8){
+                std::cerr << "Invalid pyramid level: " << pyramidLevel << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--bit_depth") == 0){
+            bitDepth = atoi(argv[index++]);
+            if(bitDepth < 1 || bitDepth > 16){
+                std::cerr << "Invalid bit depth: " << bitDepth << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--num_bins") == 0){
+            numBins = atoi(argv[index++]);
+            if(numBins < 2 || (numBins & (numBins - 1)) != 0){
+                std::cerr << "Invalid number of bins: " << numBins << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--reject_outliers") == 0){
+            monotonicityTolerance = atoi(argv[index++]);
+            if(monotonicityTolerance < 0){
+                std::cerr << "Invalid outlier tolerance: " << monotonicityTolerance << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--robust_iterations") == 0){
+            robustIterations = atoi(argv[index++]);
+            if(robustIterations < 0){
+                std::cerr << "Invalid number of robust iterations: " << robustIterations << std::endl;
+                return 2;
+            }
+        }else if(strcmp(arg,"--all_channels") == 0){
+            allChannels = true;
+        }else if(strcmp(arg,"--split_channels") == 0){
+            splitChannels = true;
+        }else if(strcmp(arg,"--incremental") == 0){
+            incremental = true;
+        }else if(strcmp(arg,"--batch") == 0){
+            char* f = argv[index++];
+            batchFile = std::string(f);
         }else if(strcmp(arg,"--silent") == 0){
             silent = true;
         }else if(strcmp(arg,"--out_file") == 0){
@@ -87,6 +652,9 @@ int main(int argc, char** argv){
         }else if(strcmp(arg,"--out_file_points") == 0){
             char* f = argv[index++];
             outFilePoints = std::string(f);
+        }else if(strcmp(arg,"--stats") == 0){
+            char* f = argv[index++];
+            statsFile = std::string(f);
         }else{
             std::cerr << "Unknown option: " << arg << std::endl;
             return 1;
@@ -94,51 +662,243 @@ int main(int argc, char** argv){
     }
     const bool writeCurveToStdOut = outFile == "-";
     const bool writePointsToFile = outFilePoints != "";
+    const bool lambdaSweep = !lambdas.empty();
+    const bool writeStatsFile = statsFile != "";
+    if(splitChannels && (!allChannels || writeCurveToStdOut)){
+        std::cerr << "Error - --split_channels requires --all_channels and --out_file." << std::endl;
+        return 1;
+    }
+    if(lambdaSweep && (solverType == CTFSolver::COMPARAMETRIC ||
+        solverType == CTFSolver::POLYNOMIAL || writePointsToFile))
+    {
+        std::cerr << "Error - --lambda_sweep cannot be used with the comparametric or polynomial solvers or --out_file_points." << std::endl;
+        return 1;
+    }
+    if(writeStatsFile && (lambdaSweep || batchFile != "")){
+        std::cerr << "Error - --stats cannot be used with --lambda_sweep or --batch." << std::endl;
+        return 1;
+    }
+    if(incremental && (lambdaSweep || batchFile != "" || writeStatsFile || writePointsToFile)){
+        std::cerr << "Error - --incremental cannot be used with --lambda_sweep, --batch, --stats or --out_file_points." << std::endl;
+        return 1;
+    }
+    if(writeStatsFile && statsFile == "-" && writeCurveToStdOut){
+        std::cerr << "Error - --stats and the curve cannot both be written to stdout." << std::endl;
+        return 1;
+    }
+    if(writeStatsFile && statsFile == "-" && !silent){
+        std::cerr << "Error - --stats - requires --silent, so the JSON is all that is written to stdout." << std::endl;
+        return 1;
+    }
+    if(numBins > (1 << bitDepth)){
+        std::cerr << "Error - --num_bins cannot be more than 2^bit_depth." << std::endl;
+        return 1;
+    }
+    const size_t numLevels = numBins > 0 ? (size_t)numBins : (size_t(1) << bitDepth);
+    if(solverType == CTFSolver::COMPARAMETRIC && numLevels != 256){
+        std::cerr << "Error - The comparametric solver only handles 8 bit sensors without bins." << std::endl;
+        return 1;
+    }
+    if(lambdaSweep && numLevels > CTFSolver::MAX_DENSE_LEVELS){
+        std::cerr << "Error - --lambda_sweep is limited to " << CTFSolver::MAX_DENSE_LEVELS << " curve values; use --num_bins." << std::endl;
+        return 1;
+    }
 
-    //Parse number of files
-    int numFiles = -1;
-    //Make sure we just landed on the --num_files argument
-    if(index >= argc || strcmp(argv[index],"--num_files") != 0){
-        std::cerr << "Error - Missing --num_files argument." << std::endl;
+    //Load the starting curve of the iterative solver
+    CTF initialCTF;
+    if(initialCTFFile != "" && !CTF::loadCTF(initialCTF, initialCTFFile)){
+        std::cerr << "Could not load initial CTF from file: " << initialCTFFile << std::endl;
+        return 3;
+    }
+
+    //A batch runs every entry of the manifest on one pool of threads.  Entries vary a lot in
+    //cost, so they are handed out one at a time as threads free up.  Nested parallel regions
+    //are turned off, so the solver's own loops(and Eigen's products, which check for an
+    //enclosing parallel region) run serially within each entry instead of oversubscribing.
+    if(batchFile != ""){
+        if(lambdaSweep || allChannels || writePointsToFile || writeCurveToStdOut){
+            std::cerr << "Error - --batch requires --out_file, and cannot be used with --lambda_sweep, --all_channels or --out_file_points." << std::endl;
+            return 1;
+        }
+        if(index < argc){
+            std::cerr << "Error - --batch cannot be used with --num_files." << std::endl;
+            return 1;
+        }
+        std::vector<BatchEntry> entries;
+        std::string errStr;
+        if(!readBatchManifest(batchFile, entries, errStr)){
+            std::cerr << "Could not read batch manifest: " << batchFile << std::endl;
+            std::cerr << "The issue was: \"" << errStr << "\"" << std::endl;
+            return 2;
+        }
+
+#ifdef _OPENMP
+        omp_set_max_active_levels(1);
+#endif
+        int numFailed = 0;
+        #pragma omp parallel for schedule(dynamic,1) reduction(+:numFailed)
+        for(int e = 0; e < (int)entries.size(); e++){
+            const BatchEntry& entry = entries[e];
+            std::stringstream ss;
+            ss << outFile << "." << entry.cameraId << "." << entry.channel;
+            const std::string entryFile = ss.str();
+
+            //Check the images up front.  Only their headers are read, so an image can still fail
+            //to decode during the solve.
+            int width, height, numChans; width = height = numChans = -1;
+            std::string entryErr;
+            std::vector<CTFSolver::ImageExposurePair> images(entry.images);
+            bool ok = CTFSolver::checkImagesOK(images, width, height, numChans, &entryErr);
+            if(ok && entry.channel >= (size_t)numChans){
+                entryErr = "Channel out of range";
+                ok = false;
+            }
+            if(ok){
+                //Decoding errors are reported per entry, since exceptions cannot leave the parallel
+                //region and would stop the other entries
+                try{
+                    CTFSolver solver(images, numSamps, lambda, entry.channel);
+                    configureSolver(solver, wFunc, solverType, sampling, seed, pyramidLevel,
+                        bitDepth, numBins, monotonicityTolerance, robustIterations, tolerance,
+                        maxIterations, polyDegree, precision, decodeThreads,
+                        initialCTFFile != "" ? &initialCTF : NULL);
+                    const std::vector<CTF> ctfs =
+                        solver.solveChannels(std::vector<size_t>(1, entry.channel));
+                    if(!writeCurveFile(entryFile, ctfs)){
+                        entryErr = "Could not write to file: " + entryFile;
+                        ok = false;
+                    }
+                }catch(const std::exception& ex){
+                    entryErr = ex.what();
+                    ok = false;
+                }
+            }
+
+            #pragma omp critical
+            {
+                if(!ok){
+                    std::cerr << "Camera " << entry.cameraId << ", channel " << entry.channel <<
+                        " failed: \"" << entryErr << "\"" << std::endl;
+                }else if(!silent){
+                    std::cout << "Camera " << entry.cameraId << ", channel " << entry.channel <<
+                        ": wrote curve to " << entryFile << std::endl;
+                }
+            }
+            numFailed += ok ? 0 : 1;
+        }
+        return numFailed == 0 ? 0 : 7;
+    }
+
+    //Read the images, then any more stacks of the same camera to solve jointly with them
+    std::vector<CTFSolver::ImageExposurePair> images;
+    std::vector< std::vector<CTFSolver::ImageExposurePair> > extraStacks;
+    int readErr = readImageList(argc, argv, index, images);
+    while(readErr == 0 && index < argc){
+        extraStacks.push_back(std::vector<CTFSolver::ImageExposurePair>());
+        readErr = readImageList(argc, argv, index, extraStacks.back());
+    }
+    if(readErr != 0){
         std::cerr << "See " << std::endl << 
             argv[0] << " --help" << std::endl;
+        return readErr;
+    }
+    if(!extraStacks.empty() && (lambdaSweep || writePointsToFile || incremental)){
+        std::cerr << "Error - Several stacks cannot be used with --lambda_sweep, --out_file_points or --incremental." << std::endl;
         return 1;
     }
-    numFiles = atoi(argv[++index]);
-    if(numFiles < 2){
-        std::cerr << "Error - At least 2 images required!" << std::endl;
-        return 2;
+    if(!extraStacks.empty() && numLevels > CTFSolver::MAX_DENSE_LEVELS &&
+        solverType != CTFSolver::POLYNOMIAL)
+    {
+        std::cerr << "Error - Several stacks are limited to " << CTFSolver::MAX_DENSE_LEVELS << " curve values; use --num_bins." << std::endl;
+        return 1;
     }
-    ++index;
 
+    //Check the images up front, which only reads their headers
+    int width, height, numChans, imageBitDepth; width = height = numChans = imageBitDepth = -1;
+    std::string errStr;
+    if(!CTFSolver::checkImagesOK(images, width, height, numChans, &errStr, &imageBitDepth)){
+        std::cerr << "Could not load 1 or more images!" << std::endl;
+        std::cerr << "The issue was: \"" << errStr << "\"" << std::endl;
+        return 6;
+    }
 
-    //Read the images
-    std::vector<CTFSolver::ImageExposurePair> images;
-    int stopIndex = index + (numFiles*2);
-    int filesRead = 0;
-    while(index < stopIndex){
-
-        //make sure we don't read too far
-        if(index >= argc){
-            std::cerr << "Error - Could not read all: " << numFiles <<
-                " files from the command line." << std::endl;
-            return 3;
+    //Stacks solved jointly are checked the same way, and must have the same channels
+    for(size_t k = 0; k < extraStacks.size(); k++){
+        int stackWidth, stackHeight, stackChans, stackBitDepth;
+        stackWidth = stackHeight = stackChans = stackBitDepth = -1;
+        if(!CTFSolver::checkImagesOK(extraStacks[k], stackWidth, stackHeight, stackChans,
+            &errStr, &stackBitDepth))
+        {
+            std::cerr << "Could not load 1 or more images of stack " << (k + 2) << "!" << std::endl;
+            std::cerr << "The issue was: \"" << errStr << "\"" << std::endl;
+            return 6;
         }
+        if(stackChans != numChans){
+            std::cerr << "Error - Stack " << (k + 2) << " has " << stackChans <<
+                " channels, but the first stack has " << numChans << "." << std::endl;
+            return 6;
+        }
+        imageBitDepth = std::max(imageBitDepth, stackBitDepth);
+    }
+    if(imageBitDepth > bitDepth && bitDepth == DFLT_BIT_DEPTH && !silent){
+        std::cerr << "Warning - The images hold " << imageBitDepth << " bit values, which are clipped to " <<
+            bitDepth << " bits; see --bit_depth." << std::endl;
+    }
 
-        //Read the pair
-        std::string path(argv[index++]);
-        double time = strtod(argv[index++], NULL);
-        images.push_back(CTFSolver::ImageExposurePair(time,path));
-
-        ++filesRead;
+    //Find which channels to solve for
+    std::vector<size_t> channels(1, chan);
+    if(allChannels){
+        channels.clear();
+        for(int c = 0; c < numChans; c++){
+            channels.push_back(c);
+        }
+    }
+    for(size_t c = 0; c < channels.size(); c++){
+        if(channels[c] >= (size_t)numChans){
+            std::cerr << "Error - Channel " << channels[c] << " is out of range; the images have " <<
+                numChans << " channels." << std::endl;
+            return 6;
+        }
     }
 
     //Potentially print info
     if(!silent){
         std::cout << "Starting linear solve for CTF creation.  Parameters: " << std::endl;
-        std::cout << "\tlambda      = " << lambda   << std::endl;
+        if(lambdaSweep){
+            std::cout << "\tlambdas     = ";
+            for(size_t l = 0; l < lambdas.size(); l++){
+                std::cout << (l == 0 ? "" : ", ") << lambdas[l];
+            }
+            std::cout << std::endl;
+        }else{
+            std::cout << "\tlambda      = " << lambda   << std::endl;
+        }
         std::cout << "\tnum_samples = " << numSamps << std::endl;
-        std::cout << "\tchannel     = " << chan     << std::endl;
+        if(incremental){
+            std::cout << "\tincremental = " << images.size() << " exposures" << std::endl;
+        }
+        if(!extraStacks.empty()){
+            std::cout << "\tstacks      = " << (1 + extraStacks.size()) << std::endl;
+        }
+        if(allChannels){
+            std::cout << "\tchannels    = all(" << channels.size() << ")" << std::endl;
+        }else{
+            std::cout << "\tchannel     = " << chan     << std::endl;
+        }
+        std::cout << "\tsolver      = " << solverName(solverType) << std::endl;
+        if(solverType == CTFSolver::POLYNOMIAL){
+            std::cout << "\tpoly_degree = " << polyDegree << std::endl;
+        }
+        std::cout << "\tsampling    = " <<
+            (sampling == CTFSolver::STRATIFIED ? "stratified" : "random") << std::endl;
+        std::cout << "\tseed        = " << seed << std::endl;
+        if(pyramidLevel > 0){
+            std::cout << "\tpyramid     = level " << pyramidLevel << std::endl;
+        }
+        if(bitDepth != DFLT_BIT_DEPTH || numBins > 0){
+            std::cout << "\tbit_depth   = " << bitDepth << std::endl;
+            std::cout << "\tcurve       = " << numLevels << " values" << std::endl;
+        }
         if(writeCurveToStdOut){
             std::cout << "\tWriting curve to stdout." << std::endl;
         }else{
@@ -146,38 +906,127 @@ int main(int argc, char** argv){
         }
     }
 
-    //Set up the solver
-    CTFSolver solver(images, numSamps, lambda, chan);
-    solver.setWeightingFunc(wFunc);
+    //Set up the solver.  An incremental solve starts from the first image and adds the rest.
+    CTFSolver solver(incremental ? std::vector<CTFSolver::ImageExposurePair>(1, images[0]) :
+        images, numSamps, lambda, chan);
+    for(size_t k = 0; k < extraStacks.size(); k++){
+        solver.addStack(extraStacks[k]);
+    }
+    configureSolver(solver, wFunc, solverType, sampling, seed, pyramidLevel, bitDepth, numBins,
+        monotonicityTolerance, robustIterations, tolerance, maxIterations, polyDegree, precision,
+        decodeThreads, initialCTFFile != "" ? &initialCTF : NULL);
 
     //Setup parameters in the event that we want to return pixel irradiances
-    std::vector<CTFSolver::PixelResult> retPixels;
-    std::vector<CTFSolver::PixelResult>* retList = 
+    std::vector< std::vector<CTFSolver::PixelResult> > retPixels;
+    std::vector< std::vector<CTFSolver::PixelResult> >* retList = 
         writePointsToFile ? &retPixels : NULL;
 
     //Do the solve(takes some time)
-    CTF ctf = solver.solve(retList); 
+    //A lambda sweep gives several curves per channel, which are stored channel by channel
+    std::vector<CTF> ctfs;
+    std::vector< std::vector<CTFSolver::LambdaResult> > sweep;
+    std::vector<CTFSolver::ConvergenceInfo> convergence;
+    CTFSolver::SolveStats stats;
+    CTFSolver::StageTime total;
+    size_t curvesPerChannel = 1;
+    try{
+        if(lambdaSweep){
+            sweep = solver.sweepLambdas(channels, lambdas);
+            curvesPerChannel = lambdas.size();
+            for(size_t c = 0; c < channels.size(); c++){
+                for(size_t l = 0; l < lambdas.size(); l++){
+                    ctfs.push_back(sweep[c][l].ctf);
+                }
+            }
+        }else if(incremental){
+            CTFSolver::IncrementalState state;
+            solver.startIncremental(channels, state);
+            for(size_t j = 1; j < images.size(); j++){
+                std::string reason;
+                if(!solver.addExposure(images[j], state, &reason)){
+                    std::cerr << "Could not add image: " << images[j].imagePath << std::endl;
+                    std::cerr << "The issue was: \"" << reason << "\"" << std::endl;
+                    return 6;
+                }
+                ctfs = solver.solveIncremental(state, &convergence);
+                for(size_t c = 0; c < channels.size() && !silent; c++){
+                    std::cout << "Exposures 1-" << (j + 1) << ", channel " << channels[c] << ": " <<
+                        convergence[c].iterations << " iterations, relative residual " <<
+                        convergence[c].residual << std::endl;
+                }
+            }
+        }else{
+            const Stopwatch watch;
+            ctfs = solver.solveChannels(channels, retList, &convergence,
+                writeStatsFile ? &stats : NULL);
+            total.wallSeconds = watch.wallSeconds();
+            total.cpuSeconds  = watch.cpuSeconds();
+        }
+    }catch(const std::exception& ex){
+        //Only the headers were checked above, so an image can still fail to decode
+        std::cerr << "Could not load 1 or more images!" << std::endl;
+        std::cerr << "The issue was: \"" << ex.what() << "\"" << std::endl;
+        return 6;
+    }
 
     //Output as desired
     if(writeCurveToStdOut){
-        std::cout << ctf << std::endl;
+        writeCurves(std::cout, ctfs);
+        std::cout << std::endl;
+    }else if(splitChannels){
+        for(size_t c = 0; c < channels.size(); c++){
+            std::stringstream ss;
+            ss << outFile << "." << channels[c];
+            const std::vector<CTF> channelCtfs(ctfs.begin() + c * curvesPerChannel,
+                ctfs.begin() + (c+1) * curvesPerChannel);
+            if(!writeCurveFile(ss.str(), channelCtfs)){
+                std::cerr << "Could not write to file: " << ss.str() << std::endl;
+                return 3;
+            }
+        }
     }else{
-        std::fstream file(outFile.c_str(), std::fstream::out);
-        if(file.good()){
-            file << ctf << std::endl;
-            file.close();
-        }else{
-            file.close();
+        if(!writeCurveFile(outFile, ctfs)){
             std::cerr << "Could not write to file: " << outFile << std::endl;
             return 3;
         }
     }
 
+    //Report how the iterative solver did
+    if(solverType == CTFSolver::ITERATIVE && !lambdaSweep && !silent){
+        for(size_t c = 0; c < channels.size(); c++){
+            std::cout << "Channel " << channels[c] << ": " <<
+                (convergence[c].converged ? "converged" : "did not converge") << " after " <<
+                convergence[c].iterations << " iterations, relative residual " <<
+                convergence[c].residual << std::endl;
+        }
+    }
+
+    //Report the cross-validation error of each smoothing value, marking the best
+    if(lambdaSweep && !silent){
+        for(size_t c = 0; c < channels.size(); c++){
+            size_t best = 0;
+            for(size_t l = 1; l < lambdas.size(); l++){
+                if(sweep[c][l].cvError < sweep[c][best].cvError){
+                    best = l;
+                }
+            }
+            std::cout << "Cross-validation error, channel " << channels[c] << ":" << std::endl;
+            for(size_t l = 0; l < lambdas.size(); l++){
+                std::cout << "\tlambda = " << sweep[c][l].lambda << "\tcv_error = " <<
+                    sweep[c][l].cvError << (l == best ? "\t(best)" : "") << std::endl;
+            }
+        }
+    }
+
     //Potentially write points out
     if(writePointsToFile){
         std::fstream file(outFilePoints.c_str(), std::fstream::out);
         if(file.good()){
-            const bool wok = solver.writePixelPoints(retPixels, file);
+            bool wok = true;
+            for(size_t c = 0; c < channels.size(); c++){
+                solver.setChannelIndex(channels[c]);
+                wok = wok && solver.writePixelPoints(retPixels[c], file);
+            }
             file.close();
             if(!wok){
                 std::cerr << "Could not write pixel points to file: " << outFilePoints << std::endl;
@@ -192,6 +1041,27 @@ int main(int argc, char** argv){
 
     }
 
+    //Potentially write stats out
+    if(writeStatsFile){
+        const std::vector<std::string> warnings = statsWarnings(stats, channels);
+        if(!silent){
+            for(size_t w = 0; w < warnings.size(); w++){
+                std::cerr << "Warning - " << warnings[w] << std::endl;
+            }
+        }
+        if(statsFile == "-"){
+            writeStats(std::cout, solver, stats, total, channels, convergence, warnings);
+        }else{
+            std::fstream file(statsFile.c_str(), std::fstream::out);
+            if(!file.good()){
+                std::cerr << "Could not write stats to file: " << statsFile << std::endl;
+                return 6;
+            }
+            writeStats(file, solver, stats, total, channels, convergence, warnings);
+            file.close();
+        }
+    }
+
     //All done
     return 0;
 }
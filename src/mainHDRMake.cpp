@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 //--
 #define cimg_display 0     //Don't compile cimg to use X11 display
 #define cimg_verbosity 0   // Disable modal window in CImg exceptions.
@@ -17,7 +18,15 @@ using namespace cimg_library;
 #include "CTF.h"
 #include "CTFSolver.h"
 //--
+#include "ImageView.h"
 #include "LinearRegression.h"
+#include "MappedImage.h"
+#include "ScanlineReader.h"
+#include "Stopwatch.h"
+//--
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 static const std::string DIR_SEP("/");
 
@@ -28,10 +37,64 @@ typedef struct PixelCoord{
 }PixelCoord;
 
 
+/**
+ *  Load every image of a stack, several at once.  8 bit PGM and PPM files are mapped into
+ *  memory rather than decoded; everything else is decoded with CImg.
+ *
+ *  @param images is the exposure stack.
+ *  @param numThreads is the most images to load at once, or 0 for one per core.
+ *  @param outMapped is an unmapped image for each image in the stack, as mapped images
+ *   cannot be copied into a std::vector.  Files that can be mapped are mapped into them.
+ *  @param outDecoded is set to the decoded images, or empty images for mapped files.
+ *  @param outViews is set to a view of each image, in the same order as images.
+ *  @param outSeconds is set to the wall clock seconds each image took to load.
+ *  Loading errors are thrown once every image has been tried, since exceptions cannot
+ *  leave a parallel region.
+ */
+void loadStack(const std::vector<CTFSolver::ImageExposurePair>& images, int numThreads,
+    MappedImage* outMapped, std::vector< CImg<unsigned char> >& outDecoded,
+    std::vector<ImageView>& outViews, std::vector<double>& outSeconds)
+{
+#ifdef _OPENMP
+    if(numThreads <= 0){
+        numThreads = omp_get_max_threads();
+    }
+#endif
+    outDecoded.assign(images.size(), CImg<unsigned char>());
+    outViews.assign(images.size(), ImageView());
+    outSeconds.assign(images.size(), 0.0);
+    std::vector<std::string> loadErrors(images.size());
+
+    //Images vary in cost, so they are handed out one at a time
+    #pragma omp parallel for schedule(dynamic,1) num_threads(numThreads)
+    for(int j = 0; j < (int)images.size(); j++){
+        const Stopwatch watch;
+        if(outMapped[j].open(images[j].imagePath)){
+            outViews[j] = outMapped[j].getView();
+        }else{
+            try{
+                CImg<unsigned char>& im = outDecoded[j];
+                im.load(images[j].imagePath.c_str());
+                outViews[j] = ImageView(im.data(), im.width(), im.height(), im.spectrum(), false);
+            }catch(const std::exception& ex){
+                loadErrors[j] = ex.what();
+            }
+        }
+        outSeconds[j] = watch.wallSeconds();
+    }
+    for(size_t j = 0; j < images.size(); j++){
+        if(!loadErrors[j].empty()){
+            throw CImgIOException("%s", loadErrors[j].c_str());
+        }
+    }
+}
+
+
 /**
  *  Make an HDR and return the # of bad pixels.
  *
  *  @param images is the exposure stack.
+ *  @param ims are views of the images of the stack, in the same order as images.
  *  @param pixelsToConsider is a list of pixels that should be considered.
  *   Pixels not in this list are left untouched in outHDR.
  *  @param ctf is the tabulated camera transfer function.
@@ -43,6 +106,7 @@ typedef struct PixelCoord{
  *   If this is NULL, we won't consider it.
  */
 int makeHDR(const std::vector<CTFSolver::ImageExposurePair>& images,
+    const std::vector<ImageView>& ims,
     const std::vector<PixelCoord>& pixelsToConsider,
     const CTF& ctf,
     unsigned char validBegin, unsigned char validEnd,
@@ -51,20 +115,18 @@ int makeHDR(const std::vector<CTFSolver::ImageExposurePair>& images,
     CImg<float>* outR = NULL
     )
 {
-    //Load images
-    //guaranteed to succeed(barring that the user hasn't deleted a file a few ms ago)
-    //since we verified their existance in main(...)
-    std::vector< CImg<float> > ims;
-    for(size_t j = 0; j < images.size(); j++){
-        ims.push_back( CImg<float>(images[j].imagePath.c_str()) );
-    }
-
     int badPixCount = 0; //Count # of pixels with no samples
 
     //Sample the weighting function into a LUT
     CTF::ctf_t lut[256];
     WeightingFunctions::makeLUTHat(&(lut[0]),  validBegin, validEnd);
 
+    //Log exposure time of each image
+    std::vector<CTF::ctf_t> logExposureTimes(images.size());
+    for(size_t j = 0; j < images.size(); j++){
+        logExposureTimes[j] = static_cast<CTF::ctf_t>( log(images[j].getTime()) );
+    }
+
     //Loop over all pixels that we want to make HDR values for
     for(size_t i = 0; i < pixelsToConsider.size(); i++){
         const int x = pixelsToConsider[i].x;
@@ -77,8 +139,7 @@ int makeHDR(const std::vector<CTFSolver::ImageExposurePair>& images,
         for(size_t j = 0; j < images.size(); j++){
             const unsigned char pixelValue = ims[j](x,y);
             const CTF::ctf_t weight = lut[pixelValue];
-            const CTF::ctf_t logExposureTime = static_cast<CTF::ctf_t>(
-                log(images[j].getTime()) );
+            const CTF::ctf_t logExposureTime = logExposureTimes[j];
 
             const CTF::ctf_t ctfValue = ctf(pixelValue);
             const float denTerm = weight;
@@ -113,6 +174,7 @@ int makeHDR(const std::vector<CTFSolver::ImageExposurePair>& images,
 
 /// Same as above but optimized for the case of a linear CTF
 int makeHDRLinear(const std::vector<CTFSolver::ImageExposurePair>& images,
+    const std::vector<ImageView>& ims,
     const std::vector<PixelCoord>& pixelsToConsider,
     unsigned char validBegin, unsigned char validEnd,
     CImg<float>& outHDR,
@@ -122,14 +184,6 @@ int makeHDRLinear(const std::vector<CTFSolver::ImageExposurePair>& images,
 {
     assert(images.size() >= 2);
 
-    //Load images
-    //guaranteed to succeed(barring that the user hasn't deleted a file a few ms ago)
-    //since we verified their existance in main(...)
-    std::vector< CImg<float> > ims;
-    for(size_t j = 0; j < images.size(); j++){
-        ims.push_back( CImg<float>(images[j].imagePath.c_str()) );
-    }
-
     //Declare count to return
     int badPixCount = 0; //Count # of pixels with no samples
 
@@ -197,6 +251,229 @@ int makeHDRLinear(const std::vector<CTFSolver::ImageExposurePair>& images,
     return badPixCount;
 }
 
+/**
+ *  Fill a band of rows from an image, one row at a time.
+ *
+ *  @param reader is the open image to read from, positioned at the band's first row.  It is
+ *   ignored if whole is not empty.
+ *  @param whole is the whole image, for images the reader cannot handle, or empty.
+ *  @param y0 is the first row of the band.
+ *  @param outBand is set to the rows of the band, and is already allocated to the width of
+ *   the image, the number of rows in the band and the number of channels.
+ *  @param rowBuf is scratch space for a row of several channels.
+ *  @return true if every row was read.
+ */
+static bool readBand(ScanlineReader& reader, const CImg<unsigned char>& whole, int y0,
+    CImg<unsigned char>& outBand, std::vector<unsigned char>& rowBuf)
+{
+    const int numChans = outBand.spectrum();
+    for(int y = 0; y < outBand.height(); y++){
+        if(!whole.is_empty()){
+            for(int c = 0; c < numChans; c++){
+                std::memcpy(outBand.data(0,y,0,c), whole.data(0,y0 + y,0,c), outBand.width());
+            }
+        }else if(numChans == 1){
+            if(!reader.readRow(outBand.data(0,y))){
+                return false;
+            }
+        }else{
+            //The reader interleaves channels, CImg stores them as planes
+            rowBuf.resize(outBand.width() * numChans);
+            if(!reader.readRow(&(rowBuf[0]))){
+                return false;
+            }
+            for(int x = 0; x < outBand.width(); x++){
+                for(int c = 0; c < numChans; c++){
+                    outBand(x,y,0,c) = rowBuf[x * numChans + c];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+
+/**
+ *  Open an image to be read a band at a time.  Images the reader cannot handle are decoded
+ *  whole with CImg instead, which throws a CImgException if that fails too.
+ *
+ *  @return true if the image has the given size and number of channels, and 8 bit values.
+ */
+static bool openBands(const std::string& path, int width, int height, int numChans,
+    ScanlineReader& outReader, CImg<unsigned char>& outWhole)
+{
+    if(outReader.open(path)){
+        return outReader.getWidth() == width && outReader.getHeight() == height &&
+            outReader.getNumChans() == numChans && outReader.getBytesPerValue() == 1;
+    }
+    outWhole.load(path.c_str());
+    return outWhole.width() == width && outWhole.height() == height &&
+        outWhole.spectrum() == numChans;
+}
+
+
+/**
+ *  Make an HDR a band of rows at a time, writing each band to a PFM file as soon as it is
+ *  merged.  Only a band of each exposure is in memory at once, so memory use does not grow
+ *  with the image height.  Images that cannot be read a row at a time(see ScanlineReader)
+ *  are decoded whole up front.  The output is the same as that of makeHDR or makeHDRLinear
+ *  followed by CImg's PFM writer.
+ *
+ *  @param readers is an unopened reader for each image, as readers cannot be copied into a
+ *   std::vector.
+ *  @param bandRows is the number of rows in each band.
+ *  @param matteImagePath is the matte image, or "" to use every pixel.
+ *  @param outNumPixels is set to the number of pixels that were on in the matte.
+ *  @param outBadPixels is set to the number of bad pixels, as returned by makeHDR.
+ *  @return 0 on success, or the exit code for hdr_make to return.
+ */
+static int makeHDRStreamed(const std::vector<CTFSolver::ImageExposurePair>& images,
+    ScanlineReader* readers,
+    const CTF& ctf, bool ctfLinear,
+    unsigned char validBegin, unsigned char validEnd,
+    int width, int height, const std::string& matteImagePath,
+    int bandRows, int decodeThreads, bool silent,
+    const std::string& outFilePath,
+    size_t& outNumPixels, int& outBadPixels)
+{
+#ifdef _OPENMP
+    if(decodeThreads <= 0){
+        decodeThreads = omp_get_max_threads();
+    }
+#endif
+    const bool useMatte = matteImagePath != "";
+    outNumPixels = 0;
+    outBadPixels = 0;
+
+    //Open every exposure, and the matte
+    std::vector< CImg<unsigned char> > wholes(images.size());
+    ScanlineReader matteReader;
+    CImg<unsigned char> matteWhole;
+    try{
+        for(size_t j = 0; j < images.size(); j++){
+            if(!openBands(images[j].imagePath, width, height, 1, readers[j], wholes[j])){
+                std::cerr << "Could not load 1 or more images!" << std::endl;
+                std::cerr << "The issue was: \"" << images[j].imagePath <<
+                    " does not match the size of the other images\"" << std::endl;
+                return 7;
+            }
+            if(!silent && !wholes[j].is_empty()){
+                std::cout << "\t" << images[j].imagePath << " cannot be streamed, decoded it whole." << std::endl;
+            }
+        }
+    }catch(const CImgException& ex){
+        std::cerr << "Could not load 1 or more images!" << std::endl;
+        std::cerr << "The issue was: \"" << ex.what() << "\"" << std::endl;
+        return 7;
+    }
+    if(useMatte){
+        try{
+            if(!openBands(matteImagePath, width, height, 3, matteReader, matteWhole)){
+                std::cerr << "Invalid matte dimensions!" << std::endl;
+                return 9;
+            }
+        }catch(const CImgException& ex){
+            std::cerr << "Could not load matte image: " << matteImagePath << std::endl;
+            return 10;
+        }
+    }
+
+    //Same header and row order as CImg's PFM writer: top row first, big endian floats
+    std::FILE* outFile = std::fopen(outFilePath.c_str(), "wb");
+    if(outFile == NULL){
+        std::cerr << "Could not save 1 or more of the output images!" << std::endl;
+        return 17;
+    }
+    std::fprintf(outFile, "Pf\n%u %u\n1.0\n", (unsigned int)width, (unsigned int)height);
+
+    const Stopwatch watch;
+    std::vector< CImg<unsigned char> > bands(images.size());
+    std::vector<ImageView> bandViews(images.size());
+    std::vector< std::vector<unsigned char> > rowBufs(images.size());
+    CImg<unsigned char> matteBand;
+    std::vector<unsigned char> matteRowBuf;
+    CImg<float> hdrBand;
+    std::vector<PixelCoord> pixelsToConsider;
+    bool readOK = true;
+    bool writeOK = true;
+    for(int y0 = 0; y0 < height && readOK && writeOK; y0 += bandRows){
+        const int rows = std::min(bandRows, height - y0);
+
+        //Read the band of every exposure
+        std::vector<char> bandOK(images.size(), 1);
+        #pragma omp parallel for schedule(dynamic,1) num_threads(decodeThreads)
+        for(int j = 0; j < (int)images.size(); j++){
+            //Exceptions cannot leave a parallel region
+            try{
+                bands[j].assign(width, rows, 1, 1);
+                bandOK[j] = readBand(readers[j], wholes[j], y0, bands[j], rowBufs[j]);
+                bandViews[j] = ImageView(bands[j].data(), width, rows, 1, false);
+            }catch(const std::exception& ex){
+                bandOK[j] = 0;
+            }
+        }
+        readOK = std::find(bandOK.begin(), bandOK.end(), 0) == bandOK.end();
+        if(readOK && useMatte){
+            matteBand.assign(width, rows, 1, 3);
+            readOK = readBand(matteReader, matteWhole, y0, matteBand, matteRowBuf);
+        }
+        if(!readOK){
+            break;
+        }
+
+        //Pixels of the band to make HDR values for, in band coordinates
+        pixelsToConsider.clear();
+        for(int x = 0; x < width; x++){
+            for(int y = 0; y < rows; y++){
+                //White pixels are included
+                if( !useMatte || (
+                    matteBand(x,y,0,0) == 255 &&
+                    matteBand(x,y,0,1) == 255 &&
+                    matteBand(x,y,0,2) == 255) )
+                {
+                    pixelsToConsider.push_back( PixelCoord(x,y) );
+                }
+            }
+        }
+        outNumPixels += pixelsToConsider.size();
+
+        //Merge
+        hdrBand.assign(width, rows, 1, 1);
+        hdrBand.fill(0.0f);
+        if(ctfLinear){
+            outBadPixels += makeHDRLinear(images, bandViews, pixelsToConsider,
+                validBegin, validEnd, hdrBand);
+        }else{
+            outBadPixels += makeHDR(images, bandViews, pixelsToConsider,
+                ctf, validBegin, validEnd, hdrBand);
+        }
+
+        //Write
+        if(!cimg::endianness()){
+            cimg::invert_endianness(hdrBand.data(), hdrBand.size());
+        }
+        writeOK = std::fwrite(hdrBand.data(), sizeof(float), hdrBand.size(), outFile) == hdrBand.size();
+    }
+    writeOK = std::fclose(outFile) == 0 && writeOK;
+
+    if(!readOK){
+        std::cerr << "Could not load 1 or more images!" << std::endl;
+        std::cerr << "The issue was: \"A file ended early or is damaged\"" << std::endl;
+        std::remove(outFilePath.c_str());
+        return 7;
+    }
+    if(!writeOK){
+        std::cerr << "Could not save 1 or more of the output images!" << std::endl;
+        return 17;
+    }
+    if(!silent){
+        std::cout << "Merged " << height << " rows in bands of " << bandRows << " in " <<
+            watch.wallSeconds() << "s" << std::endl;
+    }
+    return 0;
+}
+
+
 
 
 
@@ -289,6 +566,10 @@ int main(int argc, char** argv){
             "\t--shoulder_size X   - Don't include pixel values in the range [255-X,255] in the fit." << std::endl <<
             "\t--out_r path        - Write image of residual to file \"path\"." << std::endl <<
             "\t--out_n path        - Write image of number of valid pixels to \"path\"" << std::endl <<
+            "\t--decode_threads N  - Decode N images at once.  Defaults to 0, one per core." << std::endl <<
+            "\t--band_rows K       - Merge K rows of every image at a time, writing each band as it is done," << std::endl <<
+            "\t                      so memory use does not grow with the image height.  out_file must be a" << std::endl <<
+            "\t                      .pfm image, and --out_r and --out_n cannot be used.  Defaults to 0, off." << std::endl <<
             "\t-silent             - Don't print information to stdout." << std::endl <<
             "\t-discard_bloom_pix  - Discard pixels with an immediate neighbor that is in the range [250,255]" << std::endl <<
             "";
@@ -310,6 +591,8 @@ int main(int argc, char** argv){
     bool ctfLinear = false; //Should we assume a linear CTF?
     std::string ctfFile = ""; //tabulated CTF file if we are assuming non-linear CTF
     bool silent = false; //Should we keep quiet?
+    int decodeThreads = 0; //Images to decode at once, or 0 for one per core
+    int bandRows = 0; //Rows to merge at a time, or 0 to merge whole images
     unsigned char toeSize = 0;
     unsigned char shoulderSize = 0;
     CTF ctf; //Camera transfer function
@@ -342,6 +625,18 @@ int main(int argc, char** argv){
             outRPath = args[index++];
         }else if(arg == "-discard_bloom_pix"){
             bloomStart -= 6; //This puts bloomStart at 250
+        }else if(arg == "--decode_threads"  ){
+            decodeThreads = atoi(args[index++].c_str());
+            if(decodeThreads < 0){
+                std::cerr << "Invalid number of decode threads: " << decodeThreads << std::endl;
+                return 5;
+            }
+        }else if(arg == "--band_rows"       ){
+            bandRows = atoi(args[index++].c_str());
+            if(bandRows < 0){
+                std::cerr << "Invalid number of band rows: " << bandRows << std::endl;
+                return 5;
+            }
         }else if(arg == "-silent"){
             silent = true;
         }else{ //Done parsing optional arguments
@@ -390,6 +685,18 @@ int main(int argc, char** argv){
         std::cerr << "Error - At least 2 images are required!" << std::endl;
         return 3;
     }
+
+    //Bands are written straight to a PFM file, and the visualizations are not streamed
+    if(bandRows > 0){
+        if(cimg::strcasecmp(cimg::split_filename(outFilePath.c_str()), "pfm") != 0){
+            std::cerr << "Error - --band_rows needs a .pfm output image, not: " << outFilePath << std::endl;
+            return 5;
+        }
+        if(outRPath != "" || outNPath != ""){
+            std::cerr << "Error - --band_rows cannot be used with --out_r or --out_n!" << std::endl;
+            return 5;
+        }
+    }
     //Sort the images by exposure time
     std::sort(images.begin(), images.end());
 
@@ -431,10 +738,10 @@ int main(int argc, char** argv){
 
     //Make sure all the images load
     //also, get the width and height from disk
-    int width, height, numChans; width = height = numChans = -1;
+    int width, height, numChans, bitDepth; width = height = numChans = bitDepth = -1;
     std::string errStr;
     const bool imagesOK = CTFSolver::checkImagesOK(images,
-        width, height, numChans, &errStr);
+        width, height, numChans, &errStr, &bitDepth);
     if(!imagesOK){
         std::cerr << "Could not load 1 or more images!" << std::endl;
         std::cerr << "The issue was: \"" << errStr << "\"" << std::endl;
@@ -442,6 +749,10 @@ int main(int argc, char** argv){
     }else if(numChans != 1){
         std::cerr << "Error - Only works on monochrome images!" << std::endl;
         return 4;
+    }else if(bitDepth > 8){
+        std::cerr << "Error - Only works on 8 bit images, but the images hold " << bitDepth <<
+            " bit values!" << std::endl;
+        return 4;
     }
 
     //Make the CTF
@@ -459,6 +770,11 @@ int main(int argc, char** argv){
             std::cerr << "Could not load CTF from: " << ctfFile << std::endl;
             return 33;
         }
+        if(ctf.getNumLevels() != 256){
+            std::cerr << "Error - Only 8 bit(256 value) CTFs are supported, but " << ctfFile <<
+                " has " << ctf.getNumLevels() << " values." << std::endl;
+            return 33;
+        }
 
     }
 
@@ -466,6 +782,43 @@ int main(int argc, char** argv){
     //If we got here we are able to load all the image
     //Lets make an HDR
 
+    //Streaming case, which never holds whole images
+    if(bandRows > 0){
+        ScanlineReader* readers = new ScanlineReader[images.size()];
+        size_t numPixels = 0;
+        int numCompleteErrors = 0;
+        assert(validPixBegin < validPixEnd);
+        const int result = makeHDRStreamed(images, readers,
+            ctf, ctfLinear,
+            validPixBegin, validPixEnd,
+            width, height, matteImagePath,
+            bandRows, decodeThreads, silent,
+            outFilePath,
+            numPixels, numCompleteErrors);
+        delete[] readers;
+        if(result != 0){
+            return result;
+        }
+
+        if(numPixels < 1){
+            std::remove(outFilePath.c_str());
+            std::cerr << "Error - No pixels were on in the matte!" << std::endl;
+            return 11;
+        }
+        if(numCompleteErrors > 0){
+            std::cerr << "ERROR - Found: " << numCompleteErrors <<
+                " error pixels when making HDR(s)!" << std::endl;
+            std::cerr << "\tThis means that: " << numCompleteErrors << " pixel locations had < 2 images with pixels " << 
+                " in range [" << validPixBegin << ", " << validPixEnd << "]" << std::endl;
+            const float perc = (((float)numCompleteErrors)/((float)numPixels) ) * 100.0f;
+            std::cerr << "\t" << perc << " percent of the pixels are therefore invalid!" << std::endl;
+        }
+        if(!silent){
+            std::cout << "Wrote HDR result to: " << outFilePath << std::endl;
+        }
+        return 0;
+    }
+
     //Declare mem for output image
     CImg<float> hdr(width, height, 1, 1);
 
@@ -518,6 +871,29 @@ int main(int argc, char** argv){
 
 
 
+    //Load the stack
+    //Pixel values are kept as they are stored, one byte each, and index the weight and CTF
+    //tables directly
+    MappedImage* mapped = new MappedImage[images.size()];
+    std::vector< CImg<unsigned char> > decoded;
+    std::vector<ImageView> ims;
+    std::vector<double> decodeSeconds;
+    try{
+        const Stopwatch watch;
+        loadStack(images, decodeThreads, mapped, decoded, ims, decodeSeconds);
+        if(!silent){
+            std::cout << "Loaded " << images.size() << " images in " << watch.wallSeconds() << "s:" << std::endl;
+            for(size_t j = 0; j < images.size(); j++){
+                std::cout << "\t" << images[j].imagePath << ": " << decodeSeconds[j] << "s" << std::endl;
+            }
+        }
+    }catch(const CImgException& ex){
+        delete[] mapped;
+        std::cerr << "Could not load 1 or more images!" << std::endl;
+        std::cerr << "The issue was: \"" << ex.what() << "\"" << std::endl;
+        return 7;
+    }
+
     //Make an HDR
 
     //Declare output images for the "N" visualization as well as the "r" visualization
@@ -532,17 +908,18 @@ int main(int argc, char** argv){
     int numCompleteErrors = -1;
     assert(validPixBegin < validPixEnd);
     if(ctfLinear){ //Linear CTF special case (faster)
-        numCompleteErrors = makeHDRLinear(images, pixelsToConsider,
+        numCompleteErrors = makeHDRLinear(images, ims, pixelsToConsider,
             validPixBegin, validPixEnd,
             hdr,
             outNPtr, outRPtr);
     }else{ //Non-linear CTF general case
-        numCompleteErrors = makeHDR(images, pixelsToConsider,
+        numCompleteErrors = makeHDR(images, ims, pixelsToConsider,
             ctf,
             validPixBegin, validPixEnd,
             hdr,
             outNPtr, outRPtr);
     }
+    delete[] mapped;
     if(numCompleteErrors > 0){
         std::cerr << "ERROR - Found: " << numCompleteErrors <<
             " error pixels when making HDR(s)!" << std::endl;